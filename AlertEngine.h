@@ -0,0 +1,329 @@
+/** Alert rules evaluated against every sample (see AlertEngine)
+    @note Kept out of main.cpp, with the lock and the microsecond clock behind AlertLock/alertMicros(), so tests/host
+          can build it on a PC.
+*/
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#if defined(__MBED__)
+#include "mbed.h"
+#else
+#include <chrono>
+#include <mutex>
+#endif
+
+#ifndef ALERT_MAX_RULES
+#define ALERT_MAX_RULES     8    // Fixed rule table, so evaluation cost per sample is bounded
+#endif
+#ifndef ALERT_BUCKETS
+#define ALERT_BUCKETS       30   // Time buckets per rolling window (resolution = window / 30)
+#endif
+#ifndef ALERT_BUDGET_US
+#define ALERT_BUDGET_US     200  // Per-sample CPU budget for evaluating every rule
+#endif
+#ifndef ALERT_MAX_THRESHOLD
+#define ALERT_MAX_THRESHOLD 100000 // Thresholds are rejected beyond +/- this (pressure is ~1000mBar)
+#endif
+
+#if defined(__MBED__)
+typedef Mutex AlertLock;
+
+/** Returns a free-running microsecond count (wraps; only differences are meaningful)
+*/
+inline uint32_t alertMicros()
+{
+    return us_ticker_read();
+}
+#else
+typedef std::mutex AlertLock;
+
+inline uint32_t alertMicros()
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+/** AlertEngine class evaluates user-defined alert rules incrementally against every sample
+    @note Rules are a threshold on the latest value, DELTA (change over a window) or MEAN (rolling mean over a window).
+    @note Window state is a ring of ALERT_BUCKETS time buckets with running totals, so a sample costs O(1) per rule
+          whatever the window length or sample rate.
+    @note Evaluated on tRealtime; rules are edited from ioQueue, hence the lock.
+    @tparam Sample Sample type: needs <temperature>, <pressure> and <lightLevel>
+*/
+template<class Sample>
+class AlertEngine
+{
+    enum Metric { TEMP, PRES, LIGHT };
+    enum Kind { THRESHOLD, DELTA, MEAN };
+
+    // AlertRule struct: one rule and its rolling window state
+    struct AlertRule
+    {
+        bool used = false;
+        Metric metric;
+        Kind kind;
+        bool above;                     // Fires when observed > threshold (else when observed < threshold)
+        float threshold;
+        uint32_t windowMs, bucketMs;
+
+        float sums[ALERT_BUCKETS];      // Per-bucket sum of (value - baseline); the baseline keeps float sums precise
+        uint16_t counts[ALERT_BUCKETS];
+        float baseline;
+        float totalSum;
+        uint32_t totalCount;
+        int head;                       // Bucket currently being filled
+        uint32_t bucket;                // Time bucket number of <head>
+        int filled;                     // Buckets completed since the rule was added (saturates at ALERT_BUCKETS)
+
+        bool active;
+        unsigned int triggers;
+        float observed;                 // Most recent value compared against the threshold
+
+        void reset(uint32_t nowMs)
+        {
+            memset(sums, 0, sizeof(sums));
+            memset(counts, 0, sizeof(counts));
+            baseline = totalSum = 0.0f;
+            totalCount = 0;
+            head = filled = 0;
+            bucket = (bucketMs > 0) ? nowMs / bucketMs : 0;
+            active = false;
+            triggers = 0;
+            observed = 0.0f;
+        }
+
+        /** Moves the ring on to the bucket for <nowMs>, retiring buckets which fell out of the window
+            @note At most ALERT_BUCKETS steps, and normally 0 or 1 per sample.
+        */
+        void advance(uint32_t nowMs)
+        {
+            uint32_t current = nowMs / bucketMs;
+            uint32_t steps = std::min(current - bucket, (uint32_t)ALERT_BUCKETS);
+            for(uint32_t i = 0; i < steps; ++i)
+            {
+                head = (head + 1) % ALERT_BUCKETS;
+                totalSum -= sums[head];
+                totalCount -= counts[head];
+                sums[head] = 0.0f;
+                counts[head] = 0;
+                if(filled < ALERT_BUCKETS) ++filled;
+            }
+            bucket = current;
+        }
+
+        /** Adds a sample and updates <observed>
+            @return Whether there is enough history to compare against the threshold
+        */
+        bool update(float value, uint32_t nowMs)
+        {
+            if(kind == THRESHOLD)
+            {
+                observed = value;
+                return true;
+            }
+
+            if(totalCount == 0 && filled == 0) baseline = value;
+            advance(nowMs);
+            sums[head] += value - baseline;
+            ++counts[head];
+            totalSum += value - baseline;
+            ++totalCount;
+
+            if(kind == MEAN)
+            {
+                observed = baseline + totalSum / totalCount;
+                return filled >= ALERT_BUCKETS - 1;
+            }
+
+            // DELTA: compare against the oldest bucket in the window
+            int oldest = (head + 1) % ALERT_BUCKETS;
+            if(filled < ALERT_BUCKETS - 1 || counts[oldest] == 0) return false;
+            observed = value - (baseline + sums[oldest] / counts[oldest]);
+            return true;
+        }
+
+        /** Formats the rule as it would be entered
+            @return Rule string, e.g. "PRES DELTA < -3.00 600"
+        */
+        std::string getData()
+        {
+            const char* metricNames[] = { "TEMP", "PRES", "LIGHT" };
+            const char* kindNames[] = { "", " DELTA", " MEAN" };
+            char data[48];
+            if(kind == THRESHOLD)
+                snprintf(data, sizeof(data), "%s %c %.2f", metricNames[metric], above ? '>' : '<', threshold);
+            else
+                snprintf(data, sizeof(data), "%s%s %c %.2f %lu", metricNames[metric], kindNames[kind], above ? '>' : '<', threshold, (unsigned long)(windowMs / 1000));
+            return data;
+        }
+    };
+
+    AlertRule rules[ALERT_MAX_RULES];
+    AlertLock rulesLock;
+
+    public:
+        uint32_t lastEvalUs = 0, worstEvalUs = 0;   // Evaluation time for the whole rule table
+        unsigned int overBudget = 0;                // Samples whose evaluation exceeded ALERT_BUDGET_US
+
+        /** Adds a rule
+            @param spec "<TEMP|PRES|LIGHT> <>|<> <value>" or "<TEMP|PRES|LIGHT> <DELTA|MEAN> <>|<> <value> <window seconds>"
+            @param nowMs Current scheduler time in ms
+            @return Rule number (from 1), 0 if <spec> is invalid (including a threshold that isn't finite or is beyond
+                    +/- ALERT_MAX_THRESHOLD), or -1 if the table is full
+        */
+        int add(std::string spec, uint32_t nowMs)
+        {
+            char metric[8], kind[8], op[2];
+            float threshold;
+            unsigned int windowS = 0;
+            AlertRule rule;
+
+            if(sscanf(spec.c_str(), "%7s %7s %1[<>] %f %u", metric, kind, op, &threshold, &windowS) == 5)
+            {
+                if(strcmp(kind, "DELTA") == 0) rule.kind = DELTA;
+                else if(strcmp(kind, "MEAN") == 0) rule.kind = MEAN;
+                else return 0;
+                if(windowS < 1 || windowS > 86400) return 0;
+            }
+            else if(sscanf(spec.c_str(), "%7s %1[<>] %f", metric, op, &threshold) == 3)
+            {
+                rule.kind = THRESHOLD;
+            }
+            else return 0;
+
+            if(!std::isfinite(threshold) || fabsf(threshold) > ALERT_MAX_THRESHOLD) return 0;
+
+            if(strcmp(metric, "TEMP") == 0) rule.metric = TEMP;
+            else if(strcmp(metric, "PRES") == 0) rule.metric = PRES;
+            else if(strcmp(metric, "LIGHT") == 0) rule.metric = LIGHT;
+            else return 0;
+
+            rule.above = (op[0] == '>');
+            rule.threshold = threshold;
+            rule.windowMs = windowS * 1000;
+            rule.bucketMs = std::max(rule.windowMs / ALERT_BUCKETS, (uint32_t)1);
+            rule.reset(nowMs);
+            rule.used = true;
+
+            rulesLock.lock();
+                for(int i = 0; i < ALERT_MAX_RULES; ++i)
+                {
+                    if(!rules[i].used)
+                    {
+                        rules[i] = rule;
+                        rulesLock.unlock();
+                        return i + 1;
+                    }
+                }
+            rulesLock.unlock();
+            return -1;
+        }
+
+        /** Removes a rule
+            @param number Rule number (from 1)
+            @return Whether the rule existed
+        */
+        bool remove(int number)
+        {
+            if(number < 1 || number > ALERT_MAX_RULES) return false;
+            rulesLock.lock();
+                bool existed = rules[number - 1].used;
+                rules[number - 1].used = false;
+            rulesLock.unlock();
+            return existed;
+        }
+
+        /** Removes every rule
+        */
+        void clear()
+        {
+            rulesLock.lock();
+                for(int i = 0; i < ALERT_MAX_RULES; ++i) rules[i].used = false;
+            rulesLock.unlock();
+        }
+
+        /** Evaluates every rule against a new sample, reporting rules which trigger or clear
+            @param sample The sample
+            @param nowMs Current scheduler time in ms
+            @param reports Receives one "[ALERT] ..." line per rule which triggered or cleared (appended)
+            @return Whether any rule is active
+            @note Called from sampleEnvironment() on tRealtime.
+        */
+        bool evaluate(const Sample& sample, uint32_t nowMs, std::string* reports)
+        {
+            uint32_t start = alertMicros();
+            bool anyActive = false;
+
+            rulesLock.lock();
+                for(int i = 0; i < ALERT_MAX_RULES; ++i)
+                {
+                    AlertRule& rule = rules[i];
+                    if(!rule.used) continue;
+
+                    float value = (rule.metric == TEMP) ? sample.temperature : (rule.metric == PRES) ? sample.pressure : sample.lightLevel;
+                    bool ready = rule.update(value, nowMs);
+                    bool triggered = ready && (rule.above ? rule.observed > rule.threshold : rule.observed < rule.threshold);
+
+                    // Report edges only, so a sustained condition doesn't flood the console
+                    if(triggered != rule.active)
+                    {
+                        rule.active = triggered;
+                        if(triggered) ++rule.triggers;
+                        char message[96];
+                        snprintf(message, sizeof(message), "[ALERT] RULE %d (%s) %s: %.2f\n", i + 1, rule.getData().c_str(), triggered ? "TRIGGERED" : "CLEARED", rule.observed);
+                        *reports += message;
+                    }
+                    anyActive = anyActive || rule.active;
+                }
+            rulesLock.unlock();
+
+            lastEvalUs = alertMicros() - start;
+            if(lastEvalUs > worstEvalUs) worstEvalUs = lastEvalUs;
+            if(lastEvalUs > ALERT_BUDGET_US) ++overBudget;
+            return anyActive;
+        }
+
+        /** Lists every rule with its state
+            @return One line per rule
+        */
+        std::string list()
+        {
+            std::string data = "";
+            rulesLock.lock();
+                for(int i = 0; i < ALERT_MAX_RULES; ++i)
+                {
+                    if(!rules[i].used) continue;
+                    char line[64];
+                    snprintf(line, sizeof(line), ": %s, LAST %.2f, TRIGGERED %u\n", rules[i].active ? "ACTIVE" : "INACTIVE", rules[i].observed, rules[i].triggers);
+                    data += std::to_string(i + 1) + " " + rules[i].getData() + line;
+                }
+            rulesLock.unlock();
+            return data.empty() ? "No alert rules\n" : data;
+        }
+
+        /** Formats every rule with its state as JSON (for /api/alerts)
+            @return JSON object
+        */
+        std::string getJson()
+        {
+            std::string json = "{\"rules\":[";
+            rulesLock.lock();
+                bool first = true;
+                for(int i = 0; i < ALERT_MAX_RULES; ++i)
+                {
+                    if(!rules[i].used) continue;
+                    char fields[64];
+                    snprintf(fields, sizeof(fields), "\",\"active\":%s,\"value\":%.4f,\"triggers\":%u}", rules[i].active ? "true" : "false", rules[i].observed, rules[i].triggers);
+                    json += (first ? "" : ",") + std::string("{\"id\":") + std::to_string(i + 1) + ",\"rule\":\"" + rules[i].getData() + fields;
+                    first = false;
+                }
+            rulesLock.unlock();
+            json += "],\"evalUs\":" + std::to_string(lastEvalUs) + ",\"worstEvalUs\":" + std::to_string(worstEvalUs)
+                  + ",\"budgetUs\":" + std::to_string(ALERT_BUDGET_US) + ",\"overBudget\":" + std::to_string(overBudget) + "}";
+            return json;
+        }
+};
@@ -0,0 +1,310 @@
+/** Write-ahead journal for buffered samples (see SampleJournal)
+    @note Kept out of main.cpp, and free of Mbed APIs apart from the CRC, so tests/host can build it on a PC.
+*/
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#if defined(__MBED__)
+#include "mbed.h"
+#include "MbedCRC.h"
+#else
+#include <unistd.h>                   // fsync(), ftruncate()
+#endif
+
+/** Computes a CRC-32 (polynomial 0x04C11DB7, reflected, as MbedCRC<POLY_32BIT_ANSI, 32>)
+    @param data Bytes to check
+    @param length Number of bytes
+    @return CRC
+    @note On a PC this is a bitwise stand-in for MbedCRC, so journals read the same on both.
+*/
+inline uint32_t journalCrc32(const void* data, size_t length)
+{
+#if defined(__MBED__)
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t value = 0;
+    ct.compute(data, length, &value);
+    return value;
+#else
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t crc = 0xFFFFFFFF;
+    for(size_t i = 0; i < length; ++i)
+    {
+        crc ^= bytes[i];
+        for(int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+#endif
+}
+
+/** SampleJournal class is a write-ahead journal on the SD card, so buffered samples survive a reset
+    @note Every sample is appended (with a CRC) as soon as it is produced. Before a block is written to data.txt an
+          INTENT record notes data.txt's length, and once it is written a CHECKPOINT record notes the last sequence in it.
+    @note On mount, an INTENT without a CHECKPOINT means the block may be torn, so data.txt is cut back to the noted length;
+          then every valid sample after the last CHECKPOINT is replayed. Replaying twice gives the same data.txt.
+    @note Sequences restart every boot. The first open() of a boot only finds earlier boots' samples; a later one
+          (remounting the card) only finds this boot's, some of which the caller may still hold in RAM.
+    @note Only used from ioQueue.
+    @tparam Record Buffered sample type: needs a default constructor, <sequence>, <dateTime> (year, month, day, hour,
+            minute, second), <sensorData> (temperature, pressure, lightLevel) and getData() formatting it as a data.txt line.
+*/
+template<class Record>
+class SampleJournal
+{
+    enum RecordType : uint8_t { SAMPLE = 1, INTENT = 2, CHECKPOINT = 3 };
+
+    // JournalRecord struct: one fixed-size record as stored in the journal file
+    struct JournalRecord
+    {
+        uint32_t sequence;
+        uint32_t dataOffset;          // INTENT only: length of data.txt before the block
+        float temperature, pressure, lightLevel;
+        uint16_t year;
+        uint8_t type, month, day, hour, minute, second;
+        uint32_t crc;                 // CRC-32 of all of the above
+
+        uint32_t computeCrc() const
+        {
+            return journalCrc32(this, offsetof(JournalRecord, crc));
+        }
+
+        bool isValid() const
+        {
+            return type >= SAMPLE && type <= CHECKPOINT && crc == computeCrc();
+        }
+
+        Record toRecord() const
+        {
+            Record data;
+            data.dateTime.year = year; data.dateTime.month = month; data.dateTime.day = day;
+            data.dateTime.hour = hour; data.dateTime.minute = minute; data.dateTime.second = second;
+            data.sensorData.temperature = temperature;
+            data.sensorData.pressure = pressure;
+            data.sensorData.lightLevel = lightLevel;
+            data.sequence = sequence;
+            return data;
+        }
+    };
+    static_assert(sizeof(JournalRecord) == 32, "Journal records must stay packed");
+
+    const char* path;                 // Journal file
+    int compactAt;                    // Compact after a flush once the journal holds this many records
+    FILE* fp = NULL;
+    int recordCount = 0;              // Records in the journal file since it was last compacted
+    uint32_t committedSequence = 0;   // Newest sequence (of this boot) known to be in data.txt
+    uint32_t heldSequence = 0;        // Journaled samples up to this sequence are held by the caller, not yet in data.txt
+    bool openedThisBoot = false;      // Whether open() has compacted away the earlier boots' samples
+
+    /** Appends one record to the journal file
+        @note Not committed: callers sync() once per batch.
+    */
+    void write(RecordType type, uint32_t sequence, uint32_t dataOffset, const Record* data)
+    {
+        JournalRecord record = {};
+        record.type = type;
+        record.sequence = sequence;
+        record.dataOffset = dataOffset;
+        if(data != NULL)
+        {
+            record.temperature = data->sensorData.temperature;
+            record.pressure = data->sensorData.pressure;
+            record.lightLevel = data->sensorData.lightLevel;
+            record.year = data->dateTime.year;
+            record.month = data->dateTime.month;
+            record.day = data->dateTime.day;
+            record.hour = data->dateTime.hour;
+            record.minute = data->dateTime.minute;
+            record.second = data->dateTime.second;
+        }
+        record.crc = record.computeCrc();
+        fwrite(&record, sizeof(record), 1, fp);
+        ++recordCount;
+    }
+
+    /** Commits everything written so far to the card
+        @return Whether it succeeded
+        @note fflush() alone only hands the data to FatFs, which keeps the partial sector and the file size in RAM
+              until f_sync(); fsync() is what makes a record survive a power cut.
+    */
+    bool sync()
+    {
+        return fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    }
+
+    /** Truncates the journal, leaving only a CHECKPOINT at <committedSequence>
+        @note Only safe when every journaled sample is in data.txt.
+    */
+    void compact()
+    {
+        fclose(fp);
+        fp = fopen(path, "w+b");
+        recordCount = 0;
+        if(fp == NULL) return;
+        write(CHECKPOINT, committedSequence, 0, NULL);
+        sync();
+    }
+
+    public:
+        /** @param journalPath Journal file (on the same card as data.txt)
+            @param compactAfter Compact after a flush once the journal holds this many records
+        */
+        SampleJournal(const char* journalPath, int compactAfter) : path(journalPath), compactAt(compactAfter) {}
+
+        /** Opens the journal and replays anything which didn't make it into data.txt
+            @param dataFile Open handle to data.txt
+            @param heldThrough Samples of this boot up to this sequence are still held in RAM and will be written by the
+                   caller's next block (0 if none), so they aren't replayed. Ignored on the first open() of a boot
+            @return Number of samples recovered, or -1 if the journal can't be opened
+            @note While samples are held the journal isn't compacted: until the CHECKPOINT of the block that writes
+                  them (see endBlock()), it is their only copy on the card.
+        */
+        int open(FILE* dataFile, uint32_t heldThrough = 0)
+        {
+            fp = fopen(path, "r+b");
+            if(fp == NULL) fp = fopen(path, "w+b");
+            if(fp == NULL) return -1;
+            if(!openedThisBoot) heldThrough = 0; // The file only holds earlier boots' sequences, which don't compare with this boot's
+
+            // Find the valid prefix (a power cut can leave a torn record at the end) and the last checkpoint/intent
+            JournalRecord record;
+            long validBytes = 0;
+            uint32_t checkpoint = 0;
+            bool intentOpen = false;
+            uint32_t intentOffset = 0;
+            while(fread(&record, sizeof(record), 1, fp) == 1 && record.isValid())
+            {
+                validBytes += sizeof(record);
+                if(record.type == CHECKPOINT)
+                {
+                    checkpoint = record.sequence;
+                    intentOpen = false;
+                }
+                else if(record.type == INTENT)
+                {
+                    intentOpen = true;
+                    intentOffset = record.dataOffset;
+                }
+            }
+
+            // Undo a block which may have been torn mid-write
+            fflush(dataFile);
+            if(intentOpen)
+            {
+                ftruncate(fileno(dataFile), intentOffset);
+                fsync(fileno(dataFile));
+            }
+
+            // Collect samples after the checkpoint (in sequence order, so duplicates are skipped)
+            std::string replay = "";
+            int replayed = 0;
+            bool holding = false;
+            uint32_t last = (checkpoint > heldThrough) ? checkpoint : heldThrough;
+            fseek(fp, 0, SEEK_SET);
+            for(long position = 0; position < validBytes; position += sizeof(record))
+            {
+                fread(&record, sizeof(record), 1, fp);
+                if(record.type != SAMPLE) continue;
+                if(record.sequence > last)
+                {
+                    replay += record.toRecord().getData();
+                    last = record.sequence;
+                    ++replayed;
+                }
+                else if(record.sequence > checkpoint)
+                {
+                    holding = true;
+                }
+            }
+
+            // Drop any torn tail, or the next scan would stop before anything appended from here on
+            fflush(fp);
+            ftruncate(fileno(fp), validBytes);
+            fseek(fp, validBytes, SEEK_SET);
+            recordCount = validBytes / sizeof(record);
+
+            // Write them back into data.txt under the same intent/checkpoint protocol, so a reset here is also recoverable
+            if(replayed > 0)
+            {
+                fseek(dataFile, 0, SEEK_END);
+                uint32_t offset = ftell(dataFile);
+
+                write(INTENT, last, offset, NULL);
+                sync();
+
+                fprintf(dataFile, "%s", replay.c_str());
+                fflush(dataFile);
+                fsync(fileno(dataFile));
+
+                write(CHECKPOINT, last, 0, NULL);
+                sync();
+            }
+
+            // Held samples aren't in data.txt yet: keep them until endBlock() checkpoints the block that writes them
+            openedThisBoot = true;
+            heldSequence = holding ? heldThrough : 0;
+            if(holding) return replayed;
+
+            // Everything journaled is now in data.txt; start afresh in this boot's sequence space
+            compact();
+            return (fp != NULL) ? replayed : -1;
+        }
+
+        /** Returns whether samples are currently being journaled
+            @return True while the journal file is open
+        */
+        bool isOpen()
+        {
+            return fp != NULL;
+        }
+
+        /** Closes the journal (e.g. on eject)
+            @note Call after the final flush, so that everything journaled is in data.txt.
+        */
+        void close()
+        {
+            if(fp == NULL) return;
+            fclose(fp);
+            fp = NULL;
+        }
+
+        /** Commits samples to the journal
+            @param records Samples to commit
+            @param count Number of samples
+            @return Whether the samples are now safely in the journal (false while it is closed, e.g. card unmounted)
+        */
+        bool append(const Record* records, int count)
+        {
+            if(fp == NULL) return false;
+            if(count <= 0) return true;
+            for(int i = 0; i < count; ++i) write(SAMPLE, records[i].sequence, 0, &records[i]);
+            return sync();
+        }
+
+        /** Records that a block ending at <lastSequence> is about to be appended to data.txt
+            @param lastSequence Sequence of the newest sample in the block
+            @param dataOffset Length of data.txt before the block
+        */
+        void beginBlock(uint32_t lastSequence, uint32_t dataOffset)
+        {
+            if(fp == NULL) return;
+            write(INTENT, lastSequence, dataOffset, NULL);
+            sync();
+        }
+
+        /** Records that the block ending at <lastSequence> is safely in data.txt, compacting the journal when it gets long
+            (or once the samples held at open() are in data.txt)
+            @param lastSequence Sequence of the newest sample in the block
+        */
+        void endBlock(uint32_t lastSequence)
+        {
+            committedSequence = lastSequence;
+            if(fp == NULL) return;
+            write(CHECKPOINT, lastSequence, 0, NULL);
+            if(!sync() || lastSequence < heldSequence) return;
+
+            bool caughtUp = (heldSequence != 0);
+            heldSequence = 0;
+            if(caughtUp || recordCount >= compactAt) compact();
+        }
+};
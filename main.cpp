@@ -4,11 +4,17 @@
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <atomic>
+#include <cmath>
 #include "BMP280_SPI.h"
 #include "SDBlockDevice.h"
 #include "FATFileSystem.h"
+#include "SampleJournal.h"
+#include "AlertEngine.h"
 #include "EthernetInterface.h"
 #include "TCPSocket.h"
+#include "FlashIAPBlockDevice.h"
+#include "TDBStore.h"
 
 // HTML Directives
 #define HTTP_STATUS_LINE "HTTP/1.0 200 OK"
@@ -33,6 +39,7 @@
 "      <h1>LDR:</h1>" "\r\n"                                                             \
 "      <p>{{3}}V</p>" "\r\n"                                                             \
 "    </div>" "\r\n"                                                                      \
+"    <a href=\"/history\">History</a>" "\r\n"                                              \
 "  </body>" "\r\n"                                                                       \
 "</html>" "\r\n"
     
@@ -41,8 +48,97 @@
                       "\r\n"                    \
                       HTTP_MESSAGE_BODY "\r\n"
 
+#define HTTP_HISTORY_BODY ""                                                             \
+"<html>" "\r\n"                                                                          \
+"  <head><title>Environmental Sensor History</title></head>" "\r\n"                      \
+"  <body style=\"display: flex; flex-flow: column wrap; align-items: center;\">" "\r\n"  \
+"    <h1>History</h1>" "\r\n"                                                            \
+"    <div style=\"display: flex; flex-flow: row wrap; align-items: center;\">" "\r\n"    \
+"      <select id=\"tier\">" "\r\n"                                                      \
+"        <option value=\"1m\">Last 4 hours (1 min)</option>" "\r\n"                      \
+"        <option value=\"1h?last=24\" selected>Last 24 hours (1 h)</option>" "\r\n"      \
+"        <option value=\"1h\">Last week (1 h)</option>" "\r\n"                           \
+"        <option value=\"1d\">Last 2 months (1 day)</option>" "\r\n"                     \
+"      </select>" "\r\n"                                                                 \
+"      <select id=\"metric\">" "\r\n"                                                    \
+"        <option value=\"0\">Temperature (C)</option>" "\r\n"                            \
+"        <option value=\"1\">Pressure (mBar)</option>" "\r\n"                            \
+"        <option value=\"2\">LDR (V)</option>" "\r\n"                                    \
+"      </select>" "\r\n"                                                                 \
+"    </div>" "\r\n"                                                                      \
+"    <canvas id=\"chart\" width=\"800\" height=\"300\"></canvas>" "\r\n"                 \
+"    <p id=\"range\"></p>" "\r\n"                                                        \
+"    <a href=\"/\">Live readings</a>" "\r\n"                                             \
+"    <script>" "\r\n"                                                                    \
+"      // Points are [start, count, tmin, tmean, tmax, pmin, pmean, pmax, lmin, lmean, lmax]" "\r\n" \
+"      function draw() {" "\r\n"                                                         \
+"        var tier = document.getElementById('tier').value, m = +document.getElementById('metric').value;" "\r\n" \
+"        fetch('/api/rollup/' + tier).then(function(r) { return r.json(); }).then(function(d) {" "\r\n" \
+"          var p = d.points, c = document.getElementById('chart'), g = c.getContext('2d');" "\r\n" \
+"          g.clearRect(0, 0, c.width, c.height);" "\r\n"                                 \
+"          if(!p.length) { document.getElementById('range').textContent = 'No data yet'; return; }" "\r\n" \
+"          var lo = Infinity, hi = -Infinity;" "\r\n"                                    \
+"          p.forEach(function(q) { lo = Math.min(lo, q[2 + 3*m]); hi = Math.max(hi, q[4 + 3*m]); });" "\r\n" \
+"          if(hi == lo) { hi += 1; lo -= 1; }" "\r\n"                                    \
+"          function x(i) { return p.length < 2 ? c.width / 2 : i * (c.width - 1) / (p.length - 1); }" "\r\n" \
+"          function y(v) { return c.height - 1 - (v - lo) * (c.height - 1) / (hi - lo); }" "\r\n" \
+"          g.fillStyle = '#cde'; g.beginPath();" "\r\n"                                  \
+"          p.forEach(function(q, i) { g.lineTo(x(i), y(q[4 + 3*m])); });" "\r\n"         \
+"          for(var i = p.length - 1; i >= 0; --i) g.lineTo(x(i), y(p[i][2 + 3*m]));" "\r\n" \
+"          g.fill();" "\r\n"                                                             \
+"          g.strokeStyle = '#036'; g.beginPath();" "\r\n"                                \
+"          p.forEach(function(q, i) { g.lineTo(x(i), y(q[3 + 3*m])); });" "\r\n"         \
+"          g.stroke();" "\r\n"                                                           \
+"          document.getElementById('range').textContent = p[0][0] + ' to ' + p[p.length - 1][0] + ': min ' + lo.toFixed(2) + ', max ' + hi.toFixed(2);" "\r\n" \
+"        });" "\r\n"                                                                     \
+"      }" "\r\n"                                                                         \
+"      document.getElementById('tier').onchange = draw;" "\r\n"                          \
+"      document.getElementById('metric').onchange = draw;" "\r\n"                        \
+"      draw();" "\r\n"                                                                   \
+"    </script>" "\r\n"                                                                   \
+"  </body>" "\r\n"                                                                       \
+"</html>" "\r\n"
+
+#define HTTP_HISTORY_TEMPLATE HTTP_STATUS_LINE "\r\n"   \
+                              HTTP_HEADER_FIELDS "\r\n" \
+                              "\r\n"                    \
+                              HTTP_HISTORY_BODY "\r\n"
+
+// JSON API responses (body appended at runtime)
+#define HTTP_JSON_HEADER_FIELDS "Content-Type: application/json"
+#define HTTP_JSON_TEMPLATE HTTP_STATUS_LINE "\r\n"        \
+                           HTTP_JSON_HEADER_FIELDS "\r\n" \
+                           "\r\n"
+
 #define BUFFER_SIZE         120 
 #define CONSUME_MAX_SECONDS 60   // Max. 1 SD write every 60 seconds (see getUserInput()->"SETT" for more details)
+#define SD_DEBOUNCE_MS      200  // Ignore SD mount toggles closer together than this (accidental double-tapping of button)
+#define CONSOLE_WAKE_MS     30000 // In low-power mode, console input is switched off this long after button B or the last keystroke
+#define DATETIME_EDIT_MS    100  // Potentiometer poll period while the user is changing the date/time
+#define LCD_ROWS            2
+#define LCD_COLUMNS         16
+#define JOURNAL_PATH        "/sd/journal.bin"
+#define JOURNAL_COMPACT_AT  600  // Journal is truncated after a flush once it holds this many records (~19KB)
+#define JOURNAL_SYNC_BATCH  16   // Records copied out of the buffer per journal write
+#define JOURNAL_LOW_POWER_BATCH 10 // In low-power mode samples are journaled this many at a time (a reset can lose up to this many)
+#define SPILL_SIZE          600  // Records kept in RAM while the SD card is unavailable (10 min at 1s; ~22KB)
+#define SD_RETRY_MIN_MS     500  // First remount retry after a failure...
+#define SD_RETRY_MAX_MS     30000 // ...doubling up to this
+#define ROLLUP_MINUTES      240  // 1 min points kept in RAM (last 4 hours)
+#define ROLLUP_HOURS        168  // 1 h points kept in RAM (last week)
+#define ROLLUP_DAYS         62   // 1 day points kept in RAM (last ~2 months)
+#define ROLLUP_LINE_MAX     160  // Longest CSV line a rollup point can format to
+#define ROLLUP_PERSIST_BATCH 8   // Points copied out of a tier per CSV write
+#define UPLINK_BACKLOG      600  // Records held for the collector until acknowledged (~22KB)
+#define UPLINK_BLOCK_RECORDS 120 // Records per DATA frame
+#define UPLINK_TIMEOUT_MS   2000 // Socket timeout for the collector connection
+#define UPLINK_RETRY_MIN_MS 1000 // First reconnect attempt after a failure...
+#define UPLINK_RETRY_MAX_MS 60000 // ...doubling up to this
+#define CONFIG_VERSION      1    // Bump when struct Config changes layout; stored blocks with another version are ignored
+#define CONFIG_KEY          "config"
+#define DATETIME_KEY        "datetime"
+#define CONFIG_FLASH_ADDRESS 0x081C0000 // Last two 128KB sectors of the F429's 2MB flash (well clear of the application image)
+#define CONFIG_FLASH_SIZE   0x40000
 
 using namespace uop_msb_200;
 using namespace std;
@@ -53,6 +149,7 @@ AnalogIn ldr(AN_LDR_PIN);
 
 // User Control Inputs
 InterruptIn btnA(BTN1_PIN);
+InterruptIn btnB(BTN2_PIN);         // Wakes the console in low-power mode
 InterruptIn btnUser(USER_BUTTON);
 AnalogIn potentiometer(PA_0);
 
@@ -64,34 +161,176 @@ DigitalOut greenLED(TRAF_GRN1_PIN);
 // Misc
 Ticker ticker;
 EthernetInterface ethernetInterface;
+TCPSocket serverSocket;
+FileHandle* console = mbed_file_handle(STDIN_FILENO); // BufferedSerial (see mbed_app.json): the default DirectSerial has no sigio()
 
 // Functions //
-void sampleEnvironment();       // Requirement 1
-void sdWrite();                 // Requirement 2 & 3
-void changePart();              // Requirement 4
-void handleDatetimeChange();    // Requirement 4
-void displayDatetime();         // Requirement 4
-void serialThread();            // Requirement 6
-void serialMessage(string);     // Requirement 6
-void getUserInput();            // Requirement 8
-void refreshServer();           // Requirement 9
-void logMessage(string, bool);  // Requirement 12
-void sdMountToggle();           // Requirement 13
+void sampleEnvironment();           // Requirement 1
+void startSampling();               // Requirement 1
+void stopSampling();                // Requirement 1
+void sdMount();                     // Requirement 2 & 3
+void sdFlush();                     // Requirement 2 & 3
+void sdEject();                     // Requirement 2 & 3
+void sdFail();                      // Requirement 2 & 3
+void journalSync();                 // Requirement 2 & 3
+void uplinkFlush();                 // Uplink
+void uplinkRetry();                 // Uplink
+void uplinkStart(string);           // Uplink
+void uplinkStop();                  // Uplink
+void changePart();                  // Requirement 4
+void handleDatetimeChange();        // Requirement 4
+void displayDatetime();             // Requirement 4
+void serialMessage(string);         // Requirement 6
+void readConsole();                 // Requirement 8
+void getUserInput(string, string);  // Requirement 8
+void networkStatus(nsapi_event_t, intptr_t); // Requirement 9
+void startServer();                 // Requirement 9
+void refreshServer();               // Requirement 9
+string getRequestPath(TCPSocket*);  // Requirement 9
+string getDashboard();              // Requirement 9
+string getRollupJson(string);       // Requirement 9
+void logMessage(string, bool);      // Requirement 12
+void sdMountToggle();               // Requirement 13
+void applyPowerPolicy();            // Low-power mode
+void consoleWake();                 // Low-power mode
+void consoleSleep();                // Low-power mode
+void loadConfig();                  // Configuration
+void applyConfig();                 // Configuration
 
 // SD Card
 static SDBlockDevice sdBlockDevice(PB_5, PB_4, PB_3, PF_3);
+FATFileSystem fileSystem("sd");     // Mounted/unmounted on sdBlockDevice by sdMount()/sdEject()
+FILE* sdFile = NULL;                // Handle to /sd/data.txt; NULL while the card is unmounted
+
+// Storage state: ABSENT (ejected by user) -> MOUNTING -> READY -> EJECTING -> ABSENT; a failed mount or write goes to FAILED, which retries
+enum StorageState { ABSENT, MOUNTING, READY, EJECTING, FAILED };
+const char* storageStateNames[] = { "ABSENT", "MOUNTING", "READY", "EJECTING", "FAILED" };
+StorageState storageState = ABSENT;
+int sdRetryEventId = 0;				// ID of the pending remount retry (0 when none)
+chrono::milliseconds sdRetryDelay(SD_RETRY_MIN_MS);
+
+/* Configuration */
+
+// Config struct: user settings that persist across reboots (stored in configStore under CONFIG_KEY)
+struct Config
+{
+    uint16_t version = CONFIG_VERSION;
+    uint16_t sampleRate = 1000;                      // Sampling period in ms (SETT)
+    uint16_t consumeThreshold = CONSUME_MAX_SECONDS; // Records buffered before a flush is queued (SETT; default 1s = 60 records a minute)
+    bool samplingEnabled = true;                     // STATE
+    bool loggingEnabled = false;                     // LOGGING
+    bool lowPowerMode = false;                       // POWER; allows deep sleep between samples when period >= 1s
+    bool lcdLive = false;                            // LIVE; shows the latest sample on the LCD's second row
+};
+
+// Settings are published as immutable snapshots: readers take activeConfig.load() once and never see a half-applied change.
+// Only the I/O thread writes a slot (see publishConfig()); only tRealtime swaps the active pointer (see applyConfig()).
+Config configSlots[3];								// Active, pending, and one free for the next edit
+atomic<const Config*> activeConfig(&configSlots[0]);	// Snapshot in force
+atomic<const Config*> pendingConfig(nullptr);		// Published but not yet applied (NULL when none)
+static FlashIAPBlockDevice configBlockDevice(CONFIG_FLASH_ADDRESS, CONFIG_FLASH_SIZE);
+TDBStore configStore(&configBlockDevice);
+bool configStoreReady = false;						// Set by loadConfig() once the store is initialised
+const Config* latestConfig();
+void publishConfig(const Config&);
 
 // Globals
-bool loggingEnabled = false;		// Switched by user-input command to enable/disable logging
-Semaphore semWrite;			 		// Semaphore released to trigger SD write
-Semaphore semSample(1, 1);	 		// Semaphore released to trigger sampling
-unsigned short sampleRate = 1000;	// Default sample rate of 1000ms
-EventQueue serialQueue;				// For queueing messages to the serial terminal
-Semaphore semDateChanging;			// Semaphore released to trigger date changing
+atomic<bool> flushPending(false);	// Set while an sdFlush() event is queued, so consecutive samples don't queue duplicates
+atomic<bool> journalPending(false);	// Set while a journalSync() event is queued
+atomic<bool> uplinkPending(false);	// Set while an uplinkFlush() event is queued
+int sampleEventId = 0;				// ID of the periodic sampling event (0 when sampling is stopped)
+int datetimeChangeEventId = 0;		// ID of the pending datetime edit poll (0 when not editing)
+int sampleEveryTicks = 0;			// In low-power mode, sample on every Nth clock tick instead of on a separate event (0 when not)
+int sampleTickCount = 0;			// Clock ticks since the last piggybacked sample
+Kernel::Clock::time_point lastSdToggle;
+
+// Event Queues & Worker Threads (Requirement 6)
+// Periodic events (sampling, clock) run on tRealtime; deferred events (SD flush, network, console) run on main()'s thread.
+// The collector uplink gets its own thread, as a send can wait on the network for up to UPLINK_TIMEOUT_MS.
+// Nothing busy-waits: between events every thread is blocked and the MCU is free to sleep.
+EventQueue rtQueue;					// Time-critical events: sampling, clock, datetime editing
+EventQueue ioQueue;					// Deferred I/O events: SD writes, web server, console input & output
+EventQueue uplinkQueue;				// Collector uplink: connect, send, wait for ACKs
+Thread tRealtime(osPriorityAboveNormal, 4096);
+Thread tUplink(osPriorityBelowNormal, 4096);
+
+/* Scheduling Latency */
+
+// LatencyStats struct: records how late a periodic event was dispatched compared to when it was due
+struct LatencyStats
+{
+    chrono::microseconds due = 0us;   // When the next dispatch is expected
+    chrono::microseconds last = 0us;  // Lateness of the most recent dispatch
+    chrono::microseconds worst = 0us; // Worst lateness seen since the event was (re)scheduled
+    
+    /** Restarts measurement for an event that has just been (re)scheduled
+        @param now Current scheduler time
+        @param period Period of the event
+    */
+    void reset(chrono::microseconds now, chrono::microseconds period)
+    {
+        due = now + period;
+        last = worst = 0us;
+    }
+
+    /** Records one dispatch of the event
+        @param now Current scheduler time
+        @param period Period of the event
+    */
+    void record(chrono::microseconds now, chrono::microseconds period)
+    {
+        last = (now > due) ? now - due : 0us; // Kernel ticks are 1ms, so early dispatches are clamped to 0
+        if(last > worst) worst = last;
+        due += period;
+    }
+};
+LowPowerTimer schedulerClock;		// Time base for latency measurement (low-power so it doesn't block deep sleep)
+LatencyStats sampleLatency, clockLatency;
+
+/* Power */
+
+bool deepSleepLocked = false;		// Whether we currently hold a sleep manager deep sleep lock
+bool consoleInputEnabled = true;	// Console RX is switched off in low-power mode (BufferedSerial's RX interrupt blocks deep sleep)
+int consoleSleepEventId = 0;		// Pending consoleSleep() event, or 0
+
+// DutyCycle struct: accumulates how long a worker thread spends awake handling events
+struct DutyCycle
+{
+    const char* name;
+    uint64_t busyUs = 0;  // Total time spent inside event handlers
+    uint32_t startUs = 0; // us_ticker value when the outermost handler started
+    int depth = 0;        // Handler nesting depth (e.g. getUserInput() -> serialMessage()); only the outermost counts
+
+    DutyCycle(const char* threadName) : name(threadName) {}
+
+    /** Formats the duty cycle against the scheduler uptime
+        @param uptime Time since the scheduler started
+        @return String describing awake time and percentage
+    */
+    string getData(chrono::microseconds uptime)
+    {
+        char data[64];
+        float percent = (uptime.count() > 0) ? (100.0f * busyUs) / uptime.count() : 0.0f;
+        sprintf(data, "%s: AWAKE %lums (%.3f%%)\n", name, (unsigned long)(busyUs / 1000), percent);
+        return data;
+    }
+};
+DutyCycle rtDuty("tRealtime"), ioDuty("main/ioQueue"), uplinkDuty("tUplink");
 
-// Threads (Requirement 6)
-Thread tSample, tSDWrite, tSerialComm, tNetComm, tDatetime, tDatetimeChange, tInput;
-osThreadId_t tDatetimeChangeId, tSDWriteId;
+// BusyScope struct: times one event handler against a DutyCycle (RAII; declare at the top of the handler)
+struct BusyScope
+{
+    DutyCycle& duty;
+
+    BusyScope(DutyCycle& d) : duty(d)
+    {
+        if(duty.depth++ == 0) duty.startUs = us_ticker_read(); // us ticker is always running while we're awake
+    }
+    ~BusyScope()
+    {
+        if(--duty.depth == 0) duty.busyUs += (uint32_t)(us_ticker_read() - duty.startUs); // Unsigned subtraction handles wrap-around
+    }
+};
 
 /* Classes & Structs */
 
@@ -116,8 +355,9 @@ struct SensorData
     */
     char* getData()
     {
-        char* data = (char*) malloc(53 * sizeof(char));
-        sprintf(data, "Temp: %.2fC | Pressure: %.2fmBar | Light: %.4fV", this->temperature, this->pressure, this->lightLevel);
+        const size_t size = 96; // Room for any realistic reading; snprintf truncates the rest rather than overflowing
+        char* data = (char*) malloc(size * sizeof(char));
+        snprintf(data, size, "Temp: %.2fC | Pressure: %.2fmBar | Light: %.4fV", this->temperature, this->pressure, this->lightLevel);
         return data;
     }
 };
@@ -142,8 +382,9 @@ struct Datetime
     */
     char* getTimestamp()
     {
-        char* timestamp = (char*) malloc(19 * sizeof(char));
-        sprintf(timestamp, "%04d-%02d-%02d %02d:%02d:%02d", this->year, this->month, this->day, this->hour, this->minute, this->second); // ISO 8601-compliant
+        const size_t size = 32;
+        char* timestamp = (char*) malloc(size * sizeof(char));
+        snprintf(timestamp, size, "%04d-%02d-%02d %02d:%02d:%02d", this->year, this->month, this->day, this->hour, this->minute, this->second); // ISO 8601-compliant
         return timestamp;
     }
 
@@ -154,11 +395,22 @@ struct Datetime
     */
     char* getTimestampLCD()
     {
-        char* timestamp = (char*) malloc(16 * sizeof(char));
-        sprintf(timestamp, "%04d-%02d-%02d %02d:%02d", this->year, this->month, this->day, this->hour, this->minute); // Removes seconds as (a) they are not set by the user; (b) they trail off the display and it looks ugly
+        const size_t size = 32;
+        char* timestamp = (char*) malloc(size * sizeof(char));
+        snprintf(timestamp, size, "%04d-%02d-%02d %02d:%02d", this->year, this->month, this->day, this->hour, this->minute); // Removes seconds as (a) they are not set by the user; (b) they trail off the display and it looks ugly
         return timestamp;
     }
     
+    /** Counts seconds since 2000-01-01 00:00:00 (365-day years, as timeInc() has no leap years)
+        @return Seconds
+    */
+    int64_t toSeconds()
+    {
+        static const unsigned short daysBefore[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+        int64_t days = (int64_t)(this->year - 2000) * 365 + daysBefore[(this->month - 1) % 12] + (this->day - 1);
+        return ((days * 24 + this->hour) * 60 + this->minute) * 60 + this->second;
+    }
+
     /** Increments the time
         @note Called every 1 second
     */
@@ -200,17 +452,252 @@ struct Datetime
     }    
 };
 Datetime dateTime;
+void saveDatetime(Datetime);        // Configuration
+
+/** RollupTier class incrementally aggregates samples into min/mean/max points at one resolution (1 min, 1 h or 1 day)
+    @note Fed from FIFOBuffer::produce() on tRealtime; read by the web server on ioQueue, hence the lock.
+    @note Completed points are kept in a RAM ring for the dashboard and appended to a CSV file alongside the SD log.
+          Points closed while the card is away wait in the ring; on the first mount the CSV's tail is read back into it.
+*/
+class RollupTier
+{
+    public:
+    enum Level { MINUTE, HOUR, DAY };
+
+    // RollupPoint struct: aggregate of every sample in one period
+    struct RollupPoint
+    {
+        uint32_t key = 0;           // Period number (see getKey())
+        Datetime start;             // Start of the period
+        uint32_t count = 0;
+        float min[3], max[3];       // Temperature, pressure, light
+        double sum[3];              // Double: a day of pressure samples is too much for a float's precision
+
+        /** Adds a sample to the aggregate
+            @param data The sample
+        */
+        void add(const SensorData& data)
+        {
+            float values[3] = { data.temperature, data.pressure, data.lightLevel };
+            for(int i = 0; i < 3; ++i)
+            {
+                if(count == 0 || values[i] < min[i]) min[i] = values[i];
+                if(count == 0 || values[i] > max[i]) max[i] = values[i];
+                sum[i] = (count == 0) ? values[i] : sum[i] + values[i];
+            }
+            ++count;
+        }
+
+        /** Formats the point as comma-separated values
+            @return "YYYY-MM-DD HH:MM,count,tmin,tmean,tmax,pmin,pmean,pmax,lmin,lmean,lmax"
+        */
+        string getData()
+        {
+            char* timestamp = start.getTimestampLCD();
+            char data[ROLLUP_LINE_MAX];
+            snprintf(data, sizeof(data), "%s,%lu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.4f,%.4f,%.4f", timestamp, (unsigned long)count,
+                    min[0], sum[0] / count, max[0], min[1], sum[1] / count, max[1], min[2], sum[2] / count, max[2]);
+            free(timestamp);
+            return data;
+        }
+
+        /** Reads the point back from a line written by getData()
+            @param line CSV line
+            @return Whether the line could be parsed
+        */
+        bool parse(const char* line)
+        {
+            int year, month, day, hour, minute;
+            unsigned long n;
+            float mean[3];
+            if(sscanf(line, "%d-%d-%d %d:%d,%lu,%f,%f,%f,%f,%f,%f,%f,%f,%f", &year, &month, &day, &hour, &minute, &n,
+                      &min[0], &mean[0], &max[0], &min[1], &mean[1], &max[1], &min[2], &mean[2], &max[2]) != 15 || n == 0) return false;
+            start.year = year; start.month = month; start.day = day;
+            start.hour = hour; start.minute = minute; start.second = 0;
+            count = n;
+            for(int i = 0; i < 3; ++i) sum[i] = (double)mean[i] * n;
+            return true;
+        }
+    };
+
+    const char* name;               // Used in /api/rollup/<name>
+    const char* path;               // CSV file on the SD card
+
+    private:
+    Level level;
+    RollupPoint* points;            // Ring of completed points
+    int capacity, head = 0, size = 0;
+    RollupPoint current;            // Point being accumulated
+    uint32_t closedCount = 0;       // Points closed since boot; the newest point in the ring is number closedCount - 1
+    uint32_t persistedCount = 0;    // Points [0, persistedCount) are in the CSV file
+    bool loaded = false;            // Whether the CSV file's tail has been read back (once per boot)
+    Mutex tierLock;
+
+    /** Numbers the period containing <time>, so that a change of key means the period has ended
+    */
+    uint32_t getKey(const Datetime& time)
+    {
+        uint32_t key = (time.year * 12 + (time.month - 1)) * 31 + (time.day - 1);
+        if(level != DAY) key = key * 24 + time.hour;
+        if(level == MINUTE) key = key * 60 + time.minute;
+        return key;
+    }
+
+    public:
+        RollupTier(const char* tierName, const char* csvPath, Level tierLevel, int points)
+            : name(tierName), path(csvPath), level(tierLevel), points(new RollupPoint[points]), capacity(points) {}
+
+        /** Adds a sample, closing the current point first if the sample is in a new period
+            @param time When the sample was taken
+            @param data The sample
+            @return Whether a point was closed (and so is waiting to be persisted)
+        */
+        bool add(const Datetime& time, const SensorData& data)
+        {
+            uint32_t key = getKey(time);
+            bool isClosed = false;
+
+            tierLock.lock();
+                if(current.count > 0 && key != current.key)
+                {
+                    points[(head + size) % capacity] = current;
+                    if(size < capacity) ++size;
+                    else head = (head + 1) % capacity;
+                    ++closedCount;
+                    isClosed = true;
+                    current.count = 0;
+                }
+                if(current.count == 0)
+                {
+                    current.key = key;
+                    current.start = time;
+                    current.start.second = 0;
+                    if(level != MINUTE) current.start.minute = 0;
+                    if(level == DAY) current.start.hour = 0;
+                }
+                current.add(data);
+            tierLock.unlock();
+
+            return isClosed;
+        }
+
+        /** Copies the oldest closed points which aren't in the CSV file yet (see markPersisted())
+            @param out Array to copy points into
+            @param max Size of <out>
+            @return Number of points copied
+            @note Points which fell out of the ring before they could be written are skipped.
+        */
+        int readUnpersisted(RollupPoint* out, int max)
+        {
+            tierLock.lock();
+                int64_t oldest = (int64_t)closedCount - size; // Number of the oldest point in the ring (negative for points read back by load())
+                if((int64_t)persistedCount < oldest) persistedCount = oldest;
+                int n = (closedCount - persistedCount < (uint32_t)max) ? closedCount - persistedCount : max;
+                for(int i = 0; i < n; ++i) out[i] = points[(head + (persistedCount - oldest) + i) % capacity];
+            tierLock.unlock();
+            return n;
+        }
+
+        /** Marks the next <n> closed points as persisted, once they are in the CSV file
+            @param n Number of points returned by readUnpersisted()
+        */
+        void markPersisted(int n)
+        {
+            tierLock.lock();
+                persistedCount += n;
+            tierLock.unlock();
+        }
+
+        /** Reads the newest points back from the CSV file, so the history survives a reset
+            @note Once per boot (on the first mount). They go in front of any points closed since boot.
+            @note Runs on ioQueue; only the final merge holds the lock.
+        */
+        void load()
+        {
+            if(loaded) return;
+            loaded = true;
+            FILE* fp = fopen(path, "r");
+            if(fp == NULL) return; // Nothing persisted yet
+
+            // Only the last <capacity> lines matter, so start far enough back for them (skipping the partial first line)
+            char line[ROLLUP_LINE_MAX];
+            fseek(fp, 0, SEEK_END);
+            long start = ftell(fp) - (long)capacity * ROLLUP_LINE_MAX;
+            fseek(fp, (start > 0) ? start : 0, SEEK_SET);
+            if(start > 0) fgets(line, sizeof(line), fp);
+
+            RollupPoint* read = new RollupPoint[capacity]; // Ring of the newest lines
+            int lines = 0;
+            while(fgets(line, sizeof(line), fp) != NULL)
+            {
+                RollupPoint point;
+                if(!point.parse(line)) continue;
+                point.key = getKey(point.start);
+                read[lines++ % capacity] = point;
+            }
+            fclose(fp);
+
+            RollupPoint* merged = new RollupPoint[capacity];
+            tierLock.lock();
+                int fromFile = (lines < capacity - size) ? lines : capacity - size;
+                for(int i = 0; i < fromFile; ++i) merged[i] = read[(lines - fromFile + i) % capacity];
+                for(int i = 0; i < size; ++i) merged[fromFile + i] = points[(head + i) % capacity];
+                RollupPoint* old = points;
+                points = merged;
+                head = 0;
+                size += fromFile;
+            tierLock.unlock();
+            delete[] old;
+            delete[] read;
+        }
+
+        /** Formats the newest points (including the one in progress) as JSON (for /api/rollup)
+            @param last Maximum number of points, or <= 0 for all of them
+            @return JSON object; each point is [start, count, tmin, tmean, tmax, pmin, pmean, pmax, lmin, lmean, lmax]
+            @note Only copies the points under the lock: produce() on tRealtime takes it for every sample.
+        */
+        string getJson(int last)
+        {
+            RollupPoint* copy = new RollupPoint[capacity + 1]; // Allocated before locking, for the same reason
+            tierLock.lock();
+                int total = size + ((current.count > 0) ? 1 : 0);
+                int first = (last > 0 && last < total) ? total - last : 0;
+                for(int i = first; i < total; ++i)
+                {
+                    copy[i - first] = (i < size) ? points[(head + i) % capacity] : current;
+                }
+            tierLock.unlock();
+
+            string json = "{\"tier\":\"" + string(name) + "\",\"points\":[";
+            for(int i = 0; i < total - first; ++i)
+            {
+                string csv = copy[i].getData();
+                size_t comma = csv.find(',');
+                json += ((i == 0) ? "[\"" : ",[\"") + csv.substr(0, comma) + "\"" + csv.substr(comma) + "]";
+            }
+            delete[] copy;
+            return json + "]}";
+        }
+};
+RollupTier minuteTier("1m", "/sd/rollup_1m.csv", RollupTier::MINUTE, ROLLUP_MINUTES);
+RollupTier hourTier("1h", "/sd/rollup_1h.csv", RollupTier::HOUR, ROLLUP_HOURS);
+RollupTier dayTier("1d", "/sd/rollup_1d.csv", RollupTier::DAY, ROLLUP_DAYS);
+RollupTier* rollupTiers[] = { &minuteTier, &hourTier, &dayTier };
+
+void rollupPersist(RollupTier* tier);
 
 /** FIFOBuffer class is used to buffer data to stagger SD writes across program lifetime        
 */
 class FIFOBuffer
 {    
+    public:
     /** BufferData struct: encapsulates data which will be stored in the buffer to stagger SD writes
     */
     struct BufferData
     {
         Datetime dateTime;
         SensorData sensorData;        
+        uint32_t sequence = 0; // Assigned by produce(); increases by 1 per sample for the lifetime of the program
 
         BufferData(){}
         BufferData(Datetime time, SensorData data)
@@ -236,9 +723,10 @@ class FIFOBuffer
 
     public:
         BufferData* buffer = new BufferData[BUFFER_SIZE];      // No need to dynamically expand: buffer is to buffer SD writes, not memory
-        unsigned short consumeThreshold = CONSUME_MAX_SECONDS; // Default sample rate 1s = 60 records before a minute passes (see SETT for details)
     private:
         int itemCount = 0, freeSpace = BUFFER_SIZE;            // Buffer index trackers
+        int journaledCount = 0;                                // Records [0, journaledCount) have been handed to the journal
+        uint32_t nextSequence = 1;                             // Sequence number for the next record
         Mutex bufferLock;                                      // Lock to prevent producer and consumer functions from manipulating buffer at the same time
 
     public:    
@@ -257,15 +745,30 @@ class FIFOBuffer
                 // Write to the buffer, update counters
 				bool locked = bufferLock.trylock_for(5000ms);
 				if(!locked)	logMessage("[ERROR] Mutex timeout occurred.\n", true);
-                    buffer[itemCount++] = BufferData(dateTime, sensorData);
+                    buffer[itemCount] = BufferData(dateTime, sensorData);
+                    buffer[itemCount++].sequence = nextSequence++;
                     --freeSpace;
+                    int unjournaled = itemCount - journaledCount;
                 bufferLock.unlock();
+
+                // Commit the record to the write-ahead journal as soon as the I/O thread gets to it, or in low-power
+                // mode once a batch has built up, so the card isn't written on every wake-up
+                // (if the queue is full, clear the flag so the next sample tries again)
+                bool journalDue = !activeConfig.load()->lowPowerMode || unjournaled >= JOURNAL_LOW_POWER_BATCH;
+                if(journalDue && !journalPending.exchange(true) && ioQueue.call(journalSync) == 0) journalPending = false;
+
+                // Roll the sample up into the history tiers; completed points are persisted by the I/O thread
+                // (if the queue is full they wait in the tier, and go with the next one)
+                for(RollupTier* tier : rollupTiers)
+                {
+                    if(tier->add(dateTime, sensorData)) ioQueue.call(rollupPersist, tier);
+                }
                 //REPORT: printf("%s", buffer[itemCount-1].getData().c_str());
                 //REPORT: printf("Space: %d\n", freeSpace);
                 //REPORT: printf("Count: %d\n", itemCount);
 
                 // Also, call to consume if threshold reached
-                if(itemCount >= consumeThreshold)
+                if(itemCount >= activeConfig.load()->consumeThreshold)
                 {                 
                     consume();
                 }
@@ -277,10 +780,64 @@ class FIFOBuffer
         void consume()
         {        
             //REPORT: printf("CONSUMING...\n"); 
-                    printf("CONSUME\n");   
 
-            // Release sempahore for the tSDWrite thread.
-            semWrite.release();
+            // Defer the SD write to ioQueue (once: a flush drains everything buffered up to when it runs)
+            // If the queue is full, clear the flag so the next sample tries again instead of flushing never again
+            if(!flushPending.exchange(true) && ioQueue.call(sdFlush) == 0) flushPending = false;
+        }
+
+        /** Returns the number of records currently in the buffer.
+            @return Number of buffered records
+        */
+        int count()
+        {
+            return itemCount;
+        }
+                
+        /** Moves every record out of the buffer (used for writing blocks to the SD card)
+            @param out Array to move records into
+            @param max Size of <out>
+            @return Number of records moved
+        */
+        int drain(BufferData* out, int max)
+        {
+            bool locked = bufferLock.trylock_for(5000ms);
+			if(!locked)	logMessage("[ERROR] Mutex timeout occurred.\n", true);
+                int n = min(max, itemCount);
+                memmove(out, buffer, n * sizeof(BufferData));
+                memmove(buffer, buffer + n, (itemCount - n) * sizeof(BufferData)); // Only if <max> was too small
+                itemCount -= n;
+                freeSpace += n;
+                journaledCount = (journaledCount > n) ? journaledCount - n : 0;
+            bufferLock.unlock();
+            return n;
+        }
+
+        /** Copies the oldest records which haven't been journaled yet (see markJournaled()).
+            @param out Array to copy records into
+            @param max Size of <out>
+            @return Number of records copied
+        */
+        int readUnjournaled(BufferData* out, int max)
+        {
+            bool locked = bufferLock.trylock_for(5000ms);
+			if(!locked)	logMessage("[ERROR] Mutex timeout occurred.\n", true);
+                int n = min(max, itemCount - journaledCount);
+                memmove(out, buffer + journaledCount, n * sizeof(BufferData));
+            bufferLock.unlock();
+            return n;
+        }
+
+        /** Marks the next <n> records as journaled, once the journal has actually taken them
+            @param n Number of records returned by readUnjournaled()
+            @note Called on ioQueue, like drain(), so the records can't have moved in between.
+        */
+        void markJournaled(int n)
+        {
+            bool locked = bufferLock.trylock_for(5000ms);
+			if(!locked)	logMessage("[ERROR] Mutex timeout occurred.\n", true);
+                journaledCount = min(journaledCount + n, itemCount);
+            bufferLock.unlock();
         }
                 
         /** Reads buffer data according from specified <start> to <end>.
@@ -316,6 +873,7 @@ class FIFOBuffer
                     buffer = new BufferData[BUFFER_SIZE];
                     freeSpace = BUFFER_SIZE;                       
                     itemCount = 0;
+                    journaledCount = 0;
                 }          
             bufferLock.unlock();
 
@@ -353,385 +911,1278 @@ class FIFOBuffer
 };
 FIFOBuffer fifoBuffer;
 
+SampleJournal<FIFOBuffer::BufferData> journal(JOURNAL_PATH, JOURNAL_COMPACT_AT); // Write-ahead journal (see SampleJournal.h)
 
-/** Read sensor data and produce sample on the buffer
-    @note Semaphore self-releases but will be hogged upon user command to put thread into waiting state and disable sampling.
-    @note Runs on own thread tSample every <sampleRate> milliseconds.
-*/
-void sampleEnvironment()
-{
-    while(true)
-    {        
-        // Wait for sample semaphore (1 available by default; stolen by STATE OFF command)
-        semSample.acquire();
-
-            // Collect sample data
-            SensorData sensorData = SensorData(bmp280.getTemperature(), bmp280.getPressure(), ldr);
-            logMessage("Sampled data.\n", false);
-            
-            fifoBuffer.produce(sensorData);
-
-        semSample.release();
-        wait_us(sampleRate*1000);
-    }
-}
-
-/** Writes buffer to SD card in blocks (after successful mount).
-    @note  Will unmount and terminate when flag is set after user command or button press.
-    @note Runs on own thread tSDWrite.
+/** SpillStore class holds samples in RAM while the SD card is unavailable, until sdFlush() can catch up
+    @note Bounded ring: when full, the oldest records are dropped. Only used from ioQueue.
 */
-void sdWrite() 
+class SpillStore
 {
-	while(true)
-	{
-		SDBlockDevice sdBlockDevice(PB_5, PB_4, PB_3, PF_3); // Re-initialise
-		
-		tSDWriteId = ThisThread::get_id();
-		ThisThread::flags_clear(1 | 2); // Clear flags
-
-		// Mount the SD card
-		if(sdBlockDevice.init() != 0) 
-		{
-			// PLEASE NOTE: This will sporadically fail for no apparent reason. I suspect hardware fault (as supplied SD card also did not work properly).
-			// If this happens, try running the program again and it should work.
-			logMessage("[ERROR] SD mount failed.\n", true);
-		}
-		else
-		{
-			logMessage("SD mounted.\n", false);
-			greenLED = 1;
-		}
+    FIFOBuffer::BufferData* records = new FIFOBuffer::BufferData[SPILL_SIZE];
+    int head = 0, size = 0;             // Index of the oldest record, number of records
 
-		// Open the file
-		FATFileSystem fs("sd", &sdBlockDevice);
-		FILE* fp = fopen("/sd/data.txt", "a");    
-		if(fp == NULL) 
-		{
-			logMessage("[ERROR] File cannot be opened.\n", true);
-			sdBlockDevice.deinit();
-		}    
-
-		// Runs until flag is sent to unmount the card
-		while (ThisThread::flags_get() == 0) 
-		{
-			semWrite.acquire(); // Puts into waiting state until semaphore released by another process                
-			//REPORT: printf("Writing to card...");        
-			string buffer_contents = fifoBuffer.readBuffer(-1, 0, true);        
-			//REPORT: printf("%s", buffer_contents.c_str());
-			fprintf(fp, "%s", buffer_contents.c_str());
-			logMessage("Wrote data block to SD card.\n", false); 
-			greenLED = 1;
-		}
-
-		// Close file, unmount card, echo confirmation (spec didn't say "log it")
-		fclose(fp);
-		sdBlockDevice.deinit();
-		greenLED = 0;
-		serialQueue.call(serialMessage, "SD CARD: UNMOUNTED\n");
-
-		// While it's unmounted, put in waiting state until re-mounted
-		osSignalWait(2, 10000000);
-		osSignalClear(tSDWriteId, 2);	
-	}	
-	return;
-}
-
-/** ISR to cycle global Datetime object's changePart variable
-    @note Also signals tDatetimeChange thread to unblock.
-    @note Called on rising edge from button A.
-*/
-void changePart() 
-{    
-    if (dateTime.changePart != 5) osSignalSet(tDatetimeChangeId, 1); // Signal tDatetimeChange thread to start letting the user change the date/time (if not done being set)
-    dateTime.changePart = (dateTime.changePart < 5) ? dateTime.changePart + 1 : 0; // Cycle through parts to change. If it's already 5, then set to 0
-}
-
-/** Write current date and time from Datetime object to LCD display
-    @note Waits every 1s in synch with the natural rhythm of time.
-    @note Runs on own thread tDatetime.
-*/
-void displayDatetime()
-{    
-    while(true)
-    {
-        lcdDisplay.cls(); // Clear the display
-
-        // Print out LCD-friendly timestamp to the display
-        char* timestampLCD = dateTime.getTimestampLCD();
-        lcdDisplay.printf("%s", timestampLCD);
-        free(timestampLCD);
+    public:
+        unsigned int dropped = 0;       // Records dropped because the store was full (since boot)
 
-        // Indicate being-changed part if appropriate (why doesn't English have imperfect adjectival verbs?)
-        if (dateTime.changePart != 0) 
+        /** Appends records, dropping the oldest if there isn't room
+            @param in Records to append (oldest first)
+            @param n Number of records
+            @return Number of records dropped to make room
+        */
+        int push(const FIFOBuffer::BufferData* in, int n)
         {
-            int offset = (dateTime.changePart >= 2) ? 2 : 1; // Year needs +1 offset; others need +2 offset
+            int droppedNow = 0;
+            for(int i = 0; i < n; ++i)
+            {
+                if(size == SPILL_SIZE)
+                {
+                    head = (head + 1) % SPILL_SIZE;
+                    --size;
+                    ++droppedNow;
+                }
+                records[(head + size++) % SPILL_SIZE] = in[i];
+            }
+            dropped += droppedNow;
+            return droppedNow;
+        }
 
-            // Indicate which datetime part is being changed
-            lcdDisplay.locate(1, ((dateTime.changePart - 1) * 3) + offset);
-            lcdDisplay.printf("^^");
+        /** Returns a record by age
+            @param i 0 for the oldest record
+            @return The record
+        */
+        FIFOBuffer::BufferData& at(int i)
+        {
+            return records[(head + i) % SPILL_SIZE];
         }
 
-        if (dateTime.changePart == 0) dateTime.timeInc(); // Increment time only if it's not being changed by user
-        wait_us(1000000); // Wait 1s
-    }    
-}
+        int count()
+        {
+            return size;
+        }
 
-/** Handles user board inputs to change the date and time (via Datetime object)
-    @note Waits for button press signal. Changes are visually updated by thread tDatetime.
-    @note Runs on own thread tDatetimeChange.
+        void clear()
+        {
+            head = size = 0;
+        }
+};
+SpillStore spillStore;
+
+/** Uplink class pushes batched, compressed sample blocks to a collector over TCP, resuming from the collector's last
+    acknowledged sequence after a disconnect
+    @note Protocol (all integers little-endian):
+          board -> collector  HELLO  'H', uint8 length, board ID (MAC address), uint32 boot ID
+          collector -> board  ACK    'A', uint32 last sequence held for this board ID + boot ID (0 if none)
+          board -> collector  DATA   'D', uint32 first sequence, uint16 record count, uint16 payload length, payload
+          collector -> board  ACK    'A', uint32 last sequence held
+    @note Payload: per record, zigzag varints of the change from the previous record (the first record is relative to
+          <first sequence> and zeros) in sequence, seconds since 2000, temperature (0.01C), pressure (0.01mBar) and
+          light (0.0001V). A steady 1s stream packs into ~5 bytes per record instead of ~80 as text.
+    @note Sequences restart every boot, hence the boot ID.
+    @note tools/collector.py is a stand-in collector for a Linux host.
+    @note The socket is only used from uplinkQueue (tUplink), so a slow collector can't hold up SD writes or the
+          console. enqueue() is called from ioQueue and getData() from the console, hence the lock. It only covers
+          the backlog and counters, never a socket call.
 */
-void handleDatetimeChange()
+class Uplink
 {
-    /* START Requirement 4 - Set Date/Time */    
+    FIFOBuffer::BufferData* backlog = new FIFOBuffer::BufferData[UPLINK_BACKLOG]; // Records not yet acknowledged
+    int head = 0, size = 0;
+    TCPSocket socket;
+    atomic<bool> connected{false};
+    Mutex uplinkLock;
 
-    tDatetimeChangeId = ThisThread::get_id(); // Acquire ID for signalling 
-    btnA.rise(&changePart);
-    while(true)
+    /** Sends all of <length> bytes
+    */
+    bool sendAll(const uint8_t* data, int length)
     {
-        //REPORT: printf("Changing part %d...\n", dateTime.changePart);
-        osSignalWait(1, 10000000); // 10,000 seconds I shall wait until called upon by -R-o-h-a-n- the changePart() ISR
-        
-        if(dateTime.changePart == 1) // YEAR
-        {
-            float pot_val = potentiometer.read(); // Read potentiometer rotation (1.0 == all the way clockwise, 0.0 == all the way counter-clockwise)
-            int direction = 0; // 0 == stable
-            if(pot_val > 0.66)
-                direction = 1;
-            else if(pot_val < 0.33)
-                direction = -1;
-
-            if(direction != 0) dateTime.year += direction;
-            wait_us(1000000); // Wait 1s between reads to stop the year from zooming past the Heat Death of the Universe
-        } 
-        else if(dateTime.changePart == 2) // MONTH
-        {
-            float pot_val = potentiometer.read();       // Read potentiometer rotation
-
-            dateTime.month = 12 * pot_val;              // Multiplication of maximum value used to set value
-            if(dateTime.month == 0) dateTime.month = 1; // Minimum allowed month
-        } 
-        else if(dateTime.changePart == 3) // DAY
-        {
-            float pot_val = potentiometer.read(); 
-
-            // Maximum value will depend on the currently-set month
-            if(dateTime.month == 4 || dateTime.month == 6 || dateTime.month == 9 || dateTime.month == 11)
-                dateTime.day = 30 * pot_val;
-            else if(dateTime.month == 2)                // February: the ultimate edge case.
-                dateTime.day = 28 * pot_val;
-            else
-                dateTime.day = 31 * pot_val;
-
-            if(dateTime.day == 0) dateTime.day = 1;     // Minimum allowed day
-        } 
-        else if(dateTime.changePart == 4) // HOUR
+        while(length > 0)
         {
-            float pot_val = potentiometer.read();
-            dateTime.hour = 23 * pot_val;               // Between 00:00 and 23:00, so slightly different than other percentile calculations
-        } 
-        else if(dateTime.changePart == 5) // MINUTE
+            nsapi_size_or_error_t sent = socket.send(data, length);
+            if(sent <= 0) return false;
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    /** Waits for an ACK frame
+        @param sequence Receives the acknowledged sequence
+    */
+    bool readAck(uint32_t* sequence)
+    {
+        uint8_t frame[5];
+        int received = 0;
+        while(received < 5)
         {
-            float pot_val = potentiometer.read();
-            dateTime.minute = 59 * pot_val;
+            nsapi_size_or_error_t n = socket.recv(frame + received, 5 - received);
+            if(n <= 0) return false;
+            received += n;
         }
+        if(frame[0] != 'A') return false;
+        *sequence = frame[1] | (frame[2] << 8) | (frame[3] << 16) | ((uint32_t)frame[4] << 24);
+        return true;
     }
 
-    /* END Requirement 4 - Set Date/Time */
-}
+    /** Drops acknowledged records from the front of the backlog
+        @note Call with uplinkLock held.
+    */
+    void acknowledge(uint32_t sequence)
+    {
+        ackedSequence = sequence;
+        while(size > 0 && backlog[head].sequence <= sequence)
+        {
+            head = (head + 1) % UPLINK_BACKLOG;
+            --size;
+        }
+    }
 
-/** Continuously dispatches serial EventQueue
-    @note Runs on own thread tSerialComm.
-*/
-void serialThread()
-{
-    serialQueue.dispatch_forever();
-}
+    static int putVarint(uint8_t* out, uint64_t value)
+    {
+        int n = 0;
+        do
+        {
+            out[n++] = (value & 0x7F) | ((value > 0x7F) ? 0x80 : 0);
+            value >>= 7;
+        }
+        while(value != 0);
+        return n;
+    }
 
-/** Prints messages through the serial interface.
-    @param message The message to be printed.
-*/
-void serialMessage(string message)
-{
-    printf("%s", message.c_str());
-}
+    static int putDelta(uint8_t* out, int64_t current, int64_t previous)
+    {
+        int64_t delta = current - previous;
+        return putVarint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63)); // Zigzag: small negatives stay small
+    }
 
-/** Continuously responds to user commands through program lifetime.
-    @note Waits until user inputs a command before reacting.
-    @note Runs on own thread tInput.
-*/
-void getUserInput()
-{
-    while(true)
+    static void putU32(uint8_t* out, uint32_t value)
     {
-        serialQueue.call(serialMessage, "\nEnter a command (see Table 2 for details). Press ENTER to finish: \n");
+        for(int i = 0; i < 4; ++i) out[i] = (value >> (8 * i)) & 0xFF;
+    }
 
-        string command = "", variable = "";
-        char input_char;
-        int i = 0;
-        bool is_variable = false;
-        do
+    /** Encodes up to UPLINK_BLOCK_RECORDS records from the front of the backlog as a DATA frame
+        @param frame Receives the frame
+        @param lastSequence Receives the sequence of the last record in the frame
+        @param count Receives the number of records in the frame
+        @return Frame length, or 0 if the backlog is empty
+        @note Call with uplinkLock held.
+    */
+    int encodeBlock(uint8_t* frame, uint32_t* lastSequence, int* count)
+    {
+        if(size == 0) return 0;
+        int n = min(size, UPLINK_BLOCK_RECORDS);
+        int length = 9;
+        FIFOBuffer::BufferData& first = backlog[head];
+        int64_t previous[5] = { first.sequence, 0, 0, 0, 0 };
+        for(int i = 0; i < n; ++i)
         {
-            input_char = getchar();
-            printf("%c", input_char);
-
-            if(input_char == 10) // ENTER
-                break; // Break BEFORE appending to string
-            else if(input_char == ' ')
+            FIFOBuffer::BufferData& record = backlog[(head + i) % UPLINK_BACKLOG];
+            int64_t current[5] = { record.sequence, record.dateTime.toSeconds(), lroundf(record.sensorData.temperature * 100),
+                                   lroundf(record.sensorData.pressure * 100), lroundf(record.sensorData.lightLevel * 10000) };
+            for(int j = 0; j < 5; ++j)
             {
-                is_variable = true; // Switch to variable after space
-                continue;
+                length += putDelta(frame + length, current[j], previous[j]);
+                previous[j] = current[j];
             }
-
-            // Before space, command. After space, variable.
-            if(!is_variable) 
-                command += input_char;
-            else 
-                variable += input_char;
         }
-        while(i < 16);
-
-        // Log the command as per requirements
-        string concatenated = "Command received: " + command + " " + variable + "\n";
-        logMessage(concatenated, false);
+        frame[0] = 'D';
+        putU32(frame + 1, first.sequence);
+        frame[5] = n & 0xFF;
+        frame[6] = n >> 8;
+        frame[7] = (length - 9) & 0xFF;
+        frame[8] = (length - 9) >> 8;
+        *lastSequence = backlog[(head + n - 1) % UPLINK_BACKLOG].sequence;
+        *count = n;
+        return length;
+    }
 
-        if(command == "READ")
+    /** Connects and says HELLO; the ACK tells us where to resume
+    */
+    bool connect()
+    {
+        SocketAddress address;
+        size_t colon = collector.find(':');
+        if(colon == string::npos || ethernetInterface.gethostbyname(collector.substr(0, colon).c_str(), &address) != NSAPI_ERROR_OK) return false;
+        address.set_port(atoi(collector.c_str() + colon + 1));
+
+        socket.open(&ethernetInterface);
+        socket.set_timeout(UPLINK_TIMEOUT_MS); // Bounds how long a retry or UPLINK OFF can wait behind an unresponsive collector
+        if(socket.connect(address) != NSAPI_ERROR_OK)
         {
-            if(variable == "NOW")
-            {
-                // Reads back the current (latest) record in the FIFO (date, time, temperature, pressure, light)
-                serialQueue.call(serialMessage, fifoBuffer.readLastRecord());
-            }
+            socket.close();
+            return false;
         }
-        else if(command == "READBUFFER")
+        connected = true;
+
+        const char* boardId = ethernetInterface.get_mac_address();
+        uint8_t hello[2 + 32 + 4];
+        int length = (boardId != NULL) ? min((int)strlen(boardId), 32) : 0;
+        hello[0] = 'H';
+        hello[1] = length;
+        memcpy(hello + 2, boardId, length);
+        putU32(hello + 2 + length, bootId);
+
+        uint32_t sequence;
+        if(!sendAll(hello, 2 + length + 4) || !readAck(&sequence))
         {
-            int n = stoi(variable);
+            disconnect();
+            return false;
+        }
+        uplinkLock.lock();
+            sentBytes += 2 + length + 4;
+            acknowledge(sequence);
+        uplinkLock.unlock();
+        return true;
+    }
 
-            // N < 0: Entire buffer. N > 0: N records. Handled by readBuffer()
-            serialQueue.call(serialMessage, fifoBuffer.readBuffer(n, 0, false));
+    public:
+        string collector = "";          // "<host>:<port>"; empty when the uplink is off. Written on uplinkQueue under uplinkLock
+        uint32_t bootId = 0;
+        uint32_t ackedSequence = 0;
+        unsigned int dropped = 0;       // Records dropped because the backlog was full
+        unsigned int blocks = 0;        // DATA frames acknowledged
+        uint64_t records = 0, sentBytes = 0;
+        chrono::milliseconds retryDelay = chrono::milliseconds(UPLINK_RETRY_MIN_MS); // Only used on uplinkQueue
+        int retryEventId = 0;                                                       // Only used on uplinkQueue
+
+        /** Starts pushing to <host>:<port>
+            @note Runs on uplinkQueue.
+        */
+        void start(string hostPort)
+        {
+            disconnect();
+            uplinkLock.lock();
+                collector = hostPort;
+            uplinkLock.unlock();
+            if(bootId == 0) bootId = us_ticker_read() ^ ((uint32_t)ldr.read_u16() << 16); // Differs per boot, as sequences restart
+            retryDelay = chrono::milliseconds(UPLINK_RETRY_MIN_MS);
         }
-        else if(command == "SETT")
-        {            
-            float t = stof(variable);
-
-            if(t >= 0.1f && t <= 30.0f)
-            {      
-				// TODO: Remove this commented code before uploading report
-				// Update buffer consume threshold to compensate for time constraints (min. once per hour, max. once per minute) 
-                // This code segment attempts to balance the fact that write should be as infrequent as possible, but also there's a limit on buffer memory (and board memory, for that matter)                
-                /* -- This code cannot be implemented due to buffer read loop being unable to iterate more than 269 times without running out of memory -- 
-                unsigned short newThreshold;
-                if(t <= 1)
-                    newThreshold = CONSUME_MAX_SECONDS / t; // Flush buffer once a minute (e.g. 60/0.1 = 600 records before a MINUTE passes; 60/0.2 = 300; 60/0.9 = 67; 60/1 = 60)
-                else 
-				*/
-				
-				unsigned short newThreshold;
-				if(t > 1.0f)
+
+        /** Stops pushing and discards the backlog (so a later collector doesn't get stale records)
+            @note Runs on uplinkQueue.
+        */
+        void stop()
+        {
+            disconnect();
+            uplinkLock.lock();
+                collector = "";
+                head = size = 0;
+            uplinkLock.unlock();
+        }
+
+        void disconnect()
+        {
+            if(connected) socket.close();
+            connected = false;
+        }
+
+        /** Formats the connection state, backlog and compression counters (for UPLINK S)
+        */
+        string getData()
+        {
+            uplinkLock.lock();
+                string data = "UPLINK: " + (collector.empty() ? string("INACTIVE") : collector + (connected ? " CONNECTED" : " DISCONNECTED"))
+                            + ", ACKED " + to_string(ackedSequence) + ", " + to_string(size) + " PENDING, " + to_string(dropped) + " DROPPED\n"
+                            + "UPLINK SENT: " + to_string((unsigned long)records) + " RECORDS IN " + to_string(blocks) + " BLOCKS, "
+                            + to_string((unsigned long)sentBytes) + " BYTES\n";
+            uplinkLock.unlock();
+            return data;
+        }
+
+        /** Queues records for the collector, dropping the oldest if the backlog is full
+            @param in Records (oldest first)
+            @param n Number of records
+            @return Whether the records were queued (false when the uplink is off)
+        */
+        bool enqueue(const FIFOBuffer::BufferData* in, int n)
+        {
+            uplinkLock.lock();
+                bool active = !collector.empty();
+                for(int i = 0; active && i < n; ++i)
                 {
-                    newThreshold = CONSUME_MAX_SECONDS/t; // Flush buffer once a minute (e.g. 2s = 60/2 = 30 records before a MINUTE passes; 30s = 60/30 = 2 records
-                    fifoBuffer.consumeThreshold = newThreshold;
-                }                   
-                
-                    
-                // Set the sampling period to <t> seconds (<ms> millseconds), print string to console
-                sampleRate = t*1000;
-                string message = "T UPDATED TO " + to_string(sampleRate) + "ms";
-                serialQueue.call(serialMessage, message);
-            }
-            else
+                    if(size == UPLINK_BACKLOG)
+                    {
+                        head = (head + 1) % UPLINK_BACKLOG;
+                        --size;
+                        ++dropped;
+                    }
+                    backlog[(head + size++) % UPLINK_BACKLOG] = in[i];
+                }
+            uplinkLock.unlock();
+            return active;
+        }
+
+        /** Sends the backlog to the collector as DATA frames of up to UPLINK_BLOCK_RECORDS records
+            @return False if the collector couldn't be reached (the backlog is kept for a retry)
+            @note Runs on uplinkQueue. Each frame is encoded under the lock, then sent and acknowledged without it.
+        */
+        bool flush()
+        {
+            if(collector.empty()) return true;
+            if(!connected && !connect()) return false;
+
+            static uint8_t frame[9 + UPLINK_BLOCK_RECORDS * 30]; // Worst case 30 bytes per record
+            while(true)
             {
-                // Out of range error
-                serialQueue.call(serialMessage, "[ERROR] SETT variable out of range.\n");
+                uint32_t lastSequence;
+                int n;
+                uplinkLock.lock();
+                    int length = encodeBlock(frame, &lastSequence, &n);
+                uplinkLock.unlock();
+                if(length == 0) return true;
+
+                uint32_t sequence;
+                if(!sendAll(frame, length) || !readAck(&sequence) || sequence < lastSequence)
+                {
+                    disconnect();
+                    return false;
+                }
+                uplinkLock.lock();
+                    acknowledge(sequence);  // By sequence, so records dropped by enqueue() meanwhile are handled
+                    sentBytes += length;
+                    ++blocks;
+                    records += n;
+                uplinkLock.unlock();
             }
         }
-        else if(command == "STATE")
+};
+Uplink uplink;
+
+/** LCDRenderer class keeps a shadow framebuffer of the 16x2 display so that only changed characters are sent to it
+*/
+class LCDRenderer
+{
+    char shown[LCD_ROWS][LCD_COLUMNS];  // What the display is currently showing
+    char frame[LCD_ROWS][LCD_COLUMNS];  // What it should show after the next flush()
+
+    public:
+        LCDRenderer()
         {
-            if(variable == "ON")
-            {
-                // Start sampling
-                semSample.release();
+            memset(shown, 0, sizeof(shown)); // Not a printable character, so the first flush() draws every cell
+            clear();
+        }
 
-                // Echo confirmation string
-                serialQueue.call(serialMessage, "SAMPLING: ACTIVE\n");                
-            }
-            else if(variable == "OFF")
-            {
-                // Stop sampling                
-                semSample.acquire();
+        /** Blanks the next frame (nothing is sent until flush())
+        */
+        void clear()
+        {
+            memset(frame, ' ', sizeof(frame));
+        }
 
-                // Echo confirmation string
-                serialQueue.call(serialMessage, "SAMPLING: INACTIVE\n");
-            }
-            else
+        /** Writes text into the next frame
+            @param row Row to write on (0 or 1)
+            @param column Column to start at
+            @param text Text to write; clipped at the edge of the display
+        */
+        void print(int row, int column, const char* text)
+        {
+            if(row < 0 || row >= LCD_ROWS) return;
+            for(int i = column; i < LCD_COLUMNS && *text != '\0'; ++i, ++text)
             {
-                serialQueue.call(serialMessage, "[ERROR] STATE variable must be ON or OFF.\n");
+                if(i >= 0) frame[row][i] = *text;
             }
         }
-        else if(command == "LOGGING")
+
+        /** Sends only the cells which differ from what is being shown
+            @return Number of characters sent to the display
+            @note Consecutive changed cells are sent as one run, so the cursor is only moved once per run.
+        */
+        int flush()
         {
-             if(variable == "ON")
+            int sent = 0;
+            for(int row = 0; row < LCD_ROWS; ++row)
             {
-                // Start logging
-                loggingEnabled = true;
+                int column = 0;
+                while(column < LCD_COLUMNS)
+                {
+                    if(frame[row][column] == shown[row][column])
+                    {
+                        ++column;
+                        continue;
+                    }
 
-                // Echo confirmation string
-                serialQueue.call(serialMessage, "LOGGING: ACTIVE\n");
-                
-            }
-            else if(variable == "OFF")
-            {
-                // Stop logging                
-                loggingEnabled = false;
+                    // Gather the run of changed cells
+                    char run[LCD_COLUMNS + 1];
+                    int start = column, length = 0;
+                    while(column < LCD_COLUMNS && frame[row][column] != shown[row][column])
+                    {
+                        run[length++] = frame[row][column];
+                        shown[row][column] = frame[row][column];
+                        ++column;
+                    }
+                    run[length] = '\0';
 
-                // Echo confirmation string
-                serialQueue.call(serialMessage, "LOGGING: INACTIVE\n");
-            }
-            else
-            {
-                serialQueue.call(serialMessage, "[ERROR] LOGGING variable must be ON or OFF.\n");
+                    lcdDisplay.locate(row, start);
+                    lcdDisplay.printf("%s", run);
+                    sent += length;
+                }
             }
+            return sent;
+        }
+};
+LCDRenderer lcdRenderer;
+SensorData latestSample;			// Most recent sample, for the LCD's live readout (only touched on tRealtime)
+bool haveSample = false;
+
+AlertEngine<SensorData> alertEngine;
+
+
+/** Read sensor data and produce sample on the buffer
+    @note Periodic event on rtQueue, scheduled every <sampleRate> milliseconds by startSampling().
+    @note In low-power mode whole-second periods are driven from displayDatetime() instead, so both share one wake-up.
+*/
+void sampleEnvironment()
+{
+    BusyScope busy(rtDuty);
+    sampleLatency.record(schedulerClock.elapsed_time(), chrono::milliseconds(activeConfig.load()->sampleRate));
+
+    // Collect sample data
+    SensorData sensorData = SensorData(bmp280.getTemperature(), bmp280.getPressure(), ldr);
+    logMessage("Sampled data.\n", false);
+    latestSample = sensorData;
+    haveSample = true;
+    
+    fifoBuffer.produce(sensorData);
+    string alerts = "";
+    redLED = alertEngine.evaluate(sensorData, schedulerClock.elapsed_time().count() / 1000, &alerts);
+    if(!alerts.empty()) ioQueue.call(serialMessage, alerts);
+}
+
+/** (Re)schedules the periodic sampling event at the current <sampleRate>
+    @note Runs on rtQueue so sampling state is only ever touched by tRealtime.
+*/
+void startSampling()
+{
+    if(sampleEventId != 0) rtQueue.cancel(sampleEventId);
+    sampleEventId = 0;
+    sampleEveryTicks = 0;
+
+    const Config* config = activeConfig.load();
+    chrono::milliseconds period(config->sampleRate);
+    if(config->lowPowerMode && config->sampleRate % 1000 == 0)
+    {
+        // Piggyback on the clock tick: one wake-up per second instead of two out-of-phase ones
+        sampleLatency.reset(clockLatency.due - 1s, period);
+        sampleEveryTicks = config->sampleRate / 1000;
+        sampleTickCount = 0;
+    }
+    else
+    {
+        sampleLatency.reset(schedulerClock.elapsed_time(), period);
+        sampleEventId = rtQueue.call_every(period, sampleEnvironment);
+    }
+}
+
+/** Cancels the periodic sampling event
+    @note Runs on rtQueue.
+*/
+void stopSampling()
+{
+    if(sampleEventId != 0) rtQueue.cancel(sampleEventId);
+    sampleEventId = 0;
+    sampleEveryTicks = 0;
+}
+
+/** Mounts the SD card and opens the data file for appending.
+    @note Runs on ioQueue (at startup, from sdMountToggle(), and as a retry after a failure).
+    @note On failure, retries itself with exponential backoff; once mounted, catches up on anything spilled to RAM.
+*/
+void sdMount()
+{
+    BusyScope busy(ioDuty);
+    sdRetryEventId = 0;
+    if(storageState == READY || storageState == EJECTING) return; // Already mounted
+
+    storageState = MOUNTING;
+
+    // Mount the SD card
+    if(sdBlockDevice.init() != 0 || fileSystem.mount(&sdBlockDevice) != 0) 
+    {
+        // PLEASE NOTE: This will sporadically fail for no apparent reason. I suspect hardware fault (as supplied SD card also did not work properly).
+        // No longer fatal: it will be retried, and samples are kept in RAM in the meantime.
+        logMessage("SD mount failed.\n", false);
+        sdFail();
+        return;
+    }
+
+    // Open the file
+    sdFile = fopen("/sd/data.txt", "a");    
+    if(sdFile == NULL) 
+    {
+        logMessage("File cannot be opened.\n", false);
+        sdFail();
+        return;
+    }
+
+    // Recover any samples that were journaled but never reached data.txt (e.g. reset before a flush).
+    // Anything still spilled in RAM (e.g. a block whose write failed) is written by the catch-up flush below instead,
+    // so data.txt stays in sequence order. On the first mount of a boot the journal only holds the previous boot's
+    // samples, which all come before the spill, so they are all replayed.
+    int spilled = spillStore.count();
+    int recovered = journal.open(sdFile, (spilled > 0) ? spillStore.at(spilled - 1).sequence : 0);
+    if(recovered < 0)
+        logMessage("[ERROR] Journal cannot be opened; samples are unprotected until the next mount.\n", false);
+    else if(recovered > 0)
+        serialMessage("SD CARD: RECOVERED " + to_string(recovered) + " JOURNALED RECORDS\n");
+
+    storageState = READY;
+    sdRetryDelay = chrono::milliseconds(SD_RETRY_MIN_MS);
+    logMessage("SD mounted.\n", false);
+    greenLED = 1;
+
+    // Read the rollup history back (first mount since boot), then write points closed while the card was away
+    for(RollupTier* tier : rollupTiers)
+    {
+        tier->load();
+        rollupPersist(tier);
+    }
+
+    // Catch up on anything spilled while the card was away
+    if(spillStore.count() > 0 || fifoBuffer.count() > 0) sdFlush();
+}
+
+/** Writes the buffer to the SD card as one block, preceded by anything spilled to RAM while the card was unavailable.
+    @note Deferred event on ioQueue, queued by FIFOBuffer::consume() or the "SD F" command.
+    @note While the card isn't READY (or EJECTING) the buffer is drained into spillStore instead, so it never fills up.
+*/
+void sdFlush()
+{
+    BusyScope busy(ioDuty);
+    flushPending = false;
+
+    // Everything in the block must be journaled first, or a reset mid-block could lose it
+    journalSync();
+
+    static FIFOBuffer::BufferData records[BUFFER_SIZE]; // Static: too big for the stack, and only used on ioQueue
+    int count = fifoBuffer.drain(records, BUFFER_SIZE);
+
+    // Same cadence for the collector: hand the block over and push it once the SD write is done
+    if(count > 0 && uplink.enqueue(records, count))
+    {
+        if(!uplinkPending.exchange(true) && uplinkQueue.call(uplinkFlush) == 0) uplinkPending = false;
+    }
+
+    // Card not usable: keep the samples in RAM until it is
+    if(storageState != READY && storageState != EJECTING)
+    {
+        int dropped = spillStore.push(records, count);
+        if(dropped > 0) logMessage("SD unavailable and spill store full: dropped " + to_string(dropped) + " oldest records.\n", false);
+        return;
+    }
+
+    int spilled = spillStore.count();
+    if(count == 0 && spilled == 0) return;
+    uint32_t lastSequence = (count > 0) ? records[count - 1].sequence : spillStore.at(spilled - 1).sequence;
+
+    // Note where the block starts, so a torn block can be cut off again
+    fseek(sdFile, 0, SEEK_END);
+    uint32_t offset = ftell(sdFile);
+    journal.beginBlock(lastSequence, offset);
+
+    //REPORT: printf("Writing to card...");        
+    // Oldest first: spilled records, then the buffer. Written back-to-back and synced once, so stdio hands FAT whole sectors
+    // (fsync, not just fflush: FatFs only commits the last sector and the file size on f_sync)
+    for(int i = 0; i < spilled; ++i)
+    {
+        fputs(spillStore.at(i).getData().c_str(), sdFile);
+    }
+    for(int i = 0; i < count; ++i)
+    {
+        greenLED = !greenLED; // Flash green LED when flushing
+        fputs(records[i].getData().c_str(), sdFile);
+    }
+
+    if(fflush(sdFile) != 0 || fsync(fileno(sdFile)) != 0 || ferror(sdFile))
+    {
+        // Keep the whole block in spillStore, oldest first, so the catch-up after a remount writes it in order.
+        // The open intent cuts the torn block off again, and the journal doesn't replay what spillStore holds.
+        spillStore.push(records, count);
+        logMessage("SD write failed.\n", false);
+        sdFail();
+        return;
+    }
+
+    journal.endBlock(lastSequence);
+    spillStore.clear();
+    logMessage("Wrote data block to SD card.\n", false); 
+    if(spilled > 0) serialMessage("SD CARD: CAUGHT UP " + to_string(spilled) + " SPILLED RECORDS\n");
+    greenLED = 1;
+}
+
+/** Closes the data file and unmounts the SD card.
+    @note Runs on ioQueue, so it can never interleave with an sdFlush().
+    @note The card stays ABSENT (no automatic retries) until the user mounts it again.
+*/
+void sdEject()
+{
+    BusyScope busy(ioDuty);
+    if(storageState != READY) return; // Not mounted
+
+    storageState = EJECTING;
+    sdFlush(); // Flush buffer before ejecting
+
+    // If that flush failed the card is already torn down; the user asked for it gone, so don't retry
+    if(storageState == FAILED && sdRetryEventId != 0) ioQueue.cancel(sdRetryEventId);
+    sdRetryEventId = 0;
+
+    // Close file, unmount card, echo confirmation (spec didn't say "log it")
+    journal.close();
+    if(sdFile != NULL) fclose(sdFile);
+    sdFile = NULL;
+    fileSystem.unmount();
+    sdBlockDevice.deinit();
+    storageState = ABSENT;
+    greenLED = 0;
+    serialMessage("SD CARD: UNMOUNTED\n");
+}
+
+/** Tears down a failed mount/write and schedules a remount with exponential backoff.
+    @note Runs on ioQueue.
+*/
+void sdFail()
+{
+    journal.close();
+    if(sdFile != NULL) fclose(sdFile);
+    sdFile = NULL;
+    fileSystem.unmount();
+    sdBlockDevice.deinit();
+    storageState = FAILED;
+    greenLED = 0;
+
+    if(sdRetryEventId != 0) ioQueue.cancel(sdRetryEventId);
+    sdRetryEventId = ioQueue.call_in(sdRetryDelay, sdMount);
+    logMessage("SD retry in " + to_string((int)sdRetryDelay.count()) + "ms.\n", false);
+    sdRetryDelay = min(sdRetryDelay * 2, chrono::milliseconds(SD_RETRY_MAX_MS));
+}
+
+/** Appends a tier's completed points to its CSV file alongside the SD log.
+    @param tier The tier
+    @note Deferred event on ioQueue, queued by FIFOBuffer::produce() when a point closes, and run by sdMount() to catch
+          up on points closed while the card wasn't READY (they wait in the tier's RAM ring).
+*/
+void rollupPersist(RollupTier* tier)
+{
+    BusyScope busy(ioDuty);
+    if(storageState != READY) return;
+
+    FILE* fp = fopen(tier->path, "a");
+    if(fp == NULL)
+    {
+        logMessage("Rollup file cannot be opened.\n", false);
+        return;
+    }
+
+    RollupTier::RollupPoint batch[ROLLUP_PERSIST_BATCH];
+    int n;
+    while((n = tier->readUnpersisted(batch, ROLLUP_PERSIST_BATCH)) > 0)
+    {
+        for(int i = 0; i < n; ++i) fprintf(fp, "%s\n", batch[i].getData().c_str());
+        if(fflush(fp) != 0) break; // Left unpersisted for the next attempt
+        tier->markPersisted(n);
+    }
+    fclose(fp);
+}
+
+/** Commits newly buffered samples to the write-ahead journal.
+    @note Deferred event on ioQueue, queued by FIFOBuffer::produce() (every sample, or every JOURNAL_LOW_POWER_BATCH
+          in low-power mode), and run by sdFlush() before every block.
+    @note While the journal is closed (card unmounted or failed) records stay unjournaled, so the next sync after a
+          remount picks them up.
+*/
+void journalSync()
+{
+    BusyScope busy(ioDuty);
+    journalPending = false;
+
+    FIFOBuffer::BufferData records[JOURNAL_SYNC_BATCH];
+    int n;
+    while((n = fifoBuffer.readUnjournaled(records, JOURNAL_SYNC_BATCH)) > 0 && journal.append(records, n))
+    {
+        fifoBuffer.markJournaled(n);
+    }
+}
+
+/** Pushes the uplink backlog to the collector, retrying with exponential backoff while it can't be reached.
+    @note Event on uplinkQueue, queued by sdFlush() (i.e. every consumeThreshold samples). While a retry is scheduled
+          new records just wait in the backlog for it, so a dead collector is still only tried at the backoff rate.
+*/
+void uplinkFlush()
+{
+    BusyScope busy(uplinkDuty);
+    uplinkPending = false;
+    if(uplink.retryEventId != 0) return;
+
+    if(uplink.flush())
+    {
+        uplink.retryDelay = chrono::milliseconds(UPLINK_RETRY_MIN_MS);
+        return;
+    }
+
+    logMessage("Uplink to " + uplink.collector + " failed; retry in " + to_string((int)uplink.retryDelay.count()) + "ms.\n", false);
+    uplink.retryEventId = uplinkQueue.call_in(uplink.retryDelay, uplinkRetry);
+    uplink.retryDelay = min(uplink.retryDelay * 2, chrono::milliseconds(UPLINK_RETRY_MAX_MS));
+}
+
+/** Retries the uplink once the backoff delay has passed
+    @note Event on uplinkQueue, scheduled by uplinkFlush().
+*/
+void uplinkRetry()
+{
+    uplink.retryEventId = 0;
+    uplinkFlush();
+}
+
+/** Starts pushing every flushed block to <hostPort>
+    @note Event on uplinkQueue (from the "UPLINK <host>:<port>" command), so it can't race a flush in progress.
+*/
+void uplinkStart(string hostPort)
+{
+    BusyScope busy(uplinkDuty);
+    uplink.start(hostPort);
+}
+
+/** Stops the uplink, discarding anything unacknowledged
+    @note Event on uplinkQueue (from the "UPLINK OFF" command); runs after any flush already in progress.
+*/
+void uplinkStop()
+{
+    BusyScope busy(uplinkDuty);
+    if(uplink.retryEventId != 0) uplinkQueue.cancel(uplink.retryEventId);
+    uplink.retryEventId = 0;
+    uplink.stop();
+}
+
+/** ISR to cycle global Datetime object's changePart variable
+    @note Also queues handleDatetimeChange() to start polling the potentiometer.
+    @note Called on rising edge from button A.
+*/
+void changePart() 
+{    
+    if (dateTime.changePart != 5) rtQueue.call(handleDatetimeChange); // Start letting the user change the date/time (if not done being set)
+    dateTime.changePart = (dateTime.changePart < 5) ? dateTime.changePart + 1 : 0; // Cycle through parts to change. If it's already 5, then set to 0
+}
+
+/** Write current date and time from Datetime object to LCD display
+    @note Periodic event on rtQueue every 1s in synch with the natural rhythm of time.
+    @note Draws into lcdRenderer, which only sends the characters that changed since the last tick.
+*/
+void displayDatetime()
+{    
+    BusyScope busy(rtDuty);
+    clockLatency.record(schedulerClock.elapsed_time(), 1s);
+
+    lcdRenderer.clear();
+
+    // Print out LCD-friendly timestamp to the display
+    char* timestampLCD = dateTime.getTimestampLCD();
+    lcdRenderer.print(0, 0, timestampLCD);
+    free(timestampLCD);
+
+    // Indicate being-changed part if appropriate (why doesn't English have imperfect adjectival verbs?)
+    if (dateTime.changePart != 0) 
+    {
+        int offset = (dateTime.changePart >= 2) ? 2 : 1; // Year needs +1 offset; others need +2 offset
+
+        // Indicate which datetime part is being changed
+        lcdRenderer.print(1, ((dateTime.changePart - 1) * 3) + offset, "^^");
+    }
+    else if (activeConfig.load()->lcdLive && haveSample)
+    {
+        // Live readout of the latest sample on the second row
+        char readout[LCD_COLUMNS + 1];
+        snprintf(readout, sizeof(readout), "%.1fC %.1fmB", latestSample.temperature, latestSample.pressure);
+        lcdRenderer.print(1, 0, readout);
+    }
+
+    lcdRenderer.flush();
+
+    if (dateTime.changePart == 0) dateTime.timeInc(); // Increment time only if it's not being changed by user
+
+    // Checkpoint the clock every minute, so a reboot resumes close to the right time (and never before a rollup
+    // minute that has already closed). TDBStore wear is negligible: ~50 bytes a minute is an erase per sector every
+    // couple of days, far below the flash's 10k cycles. The snapshot is taken here, as only tRealtime writes dateTime
+    if (dateTime.changePart == 0 && dateTime.second == 0) ioQueue.call(saveDatetime, dateTime);
+
+    // Low-power mode: take the sample in this wake-up (see startSampling())
+    if(sampleEveryTicks != 0 && ++sampleTickCount >= sampleEveryTicks)
+    {
+        sampleTickCount = 0;
+        sampleEnvironment();
+    }
+}
+
+/** Handles user board inputs to change the date and time (via Datetime object)
+    @note Queued by the changePart() ISR, then re-queues itself until the user is done. Changes are visually updated by displayDatetime().
+    @note Runs on rtQueue.
+*/
+void handleDatetimeChange()
+{
+    BusyScope busy(rtDuty);
+
+    /* START Requirement 4 - Set Date/Time */    
+
+    // Only one poll may be pending: a button press queues a fresh one, so drop the old one
+    if(datetimeChangeEventId != 0) rtQueue.cancel(datetimeChangeEventId);
+    datetimeChangeEventId = 0;
+
+    //REPORT: printf("Changing part %d...\n", dateTime.changePart);
+    chrono::milliseconds next_poll(DATETIME_EDIT_MS);
+    if(dateTime.changePart == 1) // YEAR
+    {
+        float pot_val = potentiometer.read(); // Read potentiometer rotation (1.0 == all the way clockwise, 0.0 == all the way counter-clockwise)
+        int direction = 0; // 0 == stable
+        if(pot_val > 0.66)
+            direction = 1;
+        else if(pot_val < 0.33)
+            direction = -1;
+
+        if(direction != 0) dateTime.year += direction;
+        next_poll = 1s; // Wait 1s between reads to stop the year from zooming past the Heat Death of the Universe
+    } 
+    else if(dateTime.changePart == 2) // MONTH
+    {
+        float pot_val = potentiometer.read();       // Read potentiometer rotation
+
+        dateTime.month = 12 * pot_val;              // Multiplication of maximum value used to set value
+        if(dateTime.month == 0) dateTime.month = 1; // Minimum allowed month
+    } 
+    else if(dateTime.changePart == 3) // DAY
+    {
+        float pot_val = potentiometer.read(); 
+
+        // Maximum value will depend on the currently-set month
+        if(dateTime.month == 4 || dateTime.month == 6 || dateTime.month == 9 || dateTime.month == 11)
+            dateTime.day = 30 * pot_val;
+        else if(dateTime.month == 2)                // February: the ultimate edge case.
+            dateTime.day = 28 * pot_val;
+        else
+            dateTime.day = 31 * pot_val;
+
+        if(dateTime.day == 0) dateTime.day = 1;     // Minimum allowed day
+    } 
+    else if(dateTime.changePart == 4) // HOUR
+    {
+        float pot_val = potentiometer.read();
+        dateTime.hour = 23 * pot_val;               // Between 00:00 and 23:00, so slightly different than other percentile calculations
+    } 
+    else if(dateTime.changePart == 5) // MINUTE
+    {
+        float pot_val = potentiometer.read();
+        dateTime.minute = 59 * pot_val;
+    }
+
+    // Keep polling until the user cycles back to 0 (done), then keep the new datetime across reboots
+    if(dateTime.changePart != 0) datetimeChangeEventId = rtQueue.call_in(next_poll, handleDatetimeChange);
+    else ioQueue.call(saveDatetime, dateTime);
+
+    /* END Requirement 4 - Set Date/Time */
+}
+
+/** Prints messages through the serial interface.
+    @param message The message to be printed.
+*/
+void serialMessage(string message)
+{
+    BusyScope busy(ioDuty);
+    printf("%s", message.c_str());
+}
+
+/** Reads whatever has arrived on the console and assembles it into a command.
+    @note Deferred event on ioQueue, queued by the console's sigio when input is available.
+    @note Hands each completed line to getUserInput().
+*/
+void readConsole()
+{
+    BusyScope busy(ioDuty);
+    static string command = "", variable = "";
+    static bool is_variable = false;
+
+    // Typing keeps the console awake in low-power mode
+    if(consoleSleepEventId != 0)
+    {
+        ioQueue.cancel(consoleSleepEventId);
+        consoleSleepEventId = ioQueue.call_in(chrono::milliseconds(CONSOLE_WAKE_MS), consoleSleep);
+    }
+
+    char input_char;
+    while(console->readable() && console->read(&input_char, 1) == 1)
+    {
+        printf("%c", input_char);
+
+        if(input_char == 10) // ENTER
+        {
+            getUserInput(command, variable); // Hand over BEFORE appending to string
+            command = "";
+            variable = "";
+            is_variable = false;
+            continue;
         }
-        else if(command == "SD")
+        else if(input_char == ' ' && !is_variable)
         {
-            if(variable == "E")
-            {
-                // Flush AND eject the SD card (unmount)                
-				sdMountToggle();
+            is_variable = true; // Switch to variable after the first space (later spaces belong to the variable, e.g. ALERT ADD)
+            continue;
+        }
 
-                // Echo confirmation string
-                serialQueue.call(serialMessage, "SD CARD: FLUSHED, EJECTED\n");
-            }
-            else if(variable == "F")
+        // Before space, command. After space, variable.
+        if(!is_variable) 
+            command += input_char;
+        else 
+            variable += input_char;
+    }
+}
+
+/** Responds to a user command.
+    @param command The command (text before the first space)
+    @param variable The command's variable (text after the first space)
+    @note Runs on ioQueue, via readConsole().
+*/
+void getUserInput(string command, string variable)
+{
+    // Log the command as per requirements
+    string concatenated = "Command received: " + command + " " + variable + "\n";
+    logMessage(concatenated, false);
+
+    if(command == "READ")
+    {
+        if(variable == "NOW")
+        {
+            // Reads back the current (latest) record in the FIFO (date, time, temperature, pressure, light)
+            serialMessage(fifoBuffer.readLastRecord());
+        }
+    }
+    else if(command == "READBUFFER")
+    {
+        int n = stoi(variable);
+
+        // N < 0: Entire buffer. N > 0: N records. Handled by readBuffer()
+        serialMessage(fifoBuffer.readBuffer(n, 0, false));
+    }
+    else if(command == "SETT")
+    {            
+        float t = stof(variable);
+
+        if(t >= 0.1f && t <= 30.0f)
+        {      
+			// TODO: Remove this commented code before uploading report
+			// Update buffer consume threshold to compensate for time constraints (min. once per hour, max. once per minute) 
+            // This code segment attempts to balance the fact that write should be as infrequent as possible, but also there's a limit on buffer memory (and board memory, for that matter)                
+            /* -- This code cannot be implemented due to buffer read loop being unable to iterate more than 269 times without running out of memory -- 
+            unsigned short newThreshold;
+            if(t <= 1)
+                newThreshold = CONSUME_MAX_SECONDS / t; // Flush buffer once a minute (e.g. 60/0.1 = 600 records before a MINUTE passes; 60/0.2 = 300; 60/0.9 = 67; 60/1 = 60)
+            else 
+			*/
+			
+			Config config = *latestConfig();
+			unsigned short newThreshold;
+            if(t > 1.0f)
             {
-                // Flush the SD card
-                semWrite.release(); // SD write function will flush buffer
+                newThreshold = CONSUME_MAX_SECONDS/t; // Flush buffer once a minute (e.g. 2s = 60/2 = 30 records before a MINUTE passes; 30s = 60/30 = 2 records
+                config.consumeThreshold = newThreshold;
+            }                   
+            
+            // Set the sampling period to <t> seconds (<ms> millseconds); period and threshold switch together at the next sample boundary
+            config.sampleRate = t*1000;
+            publishConfig(config);
+            string message = "T UPDATED TO " + to_string(config.sampleRate) + "ms";
+            serialMessage(message);
+        }
+        else
+        {
+            // Out of range error
+            serialMessage("[ERROR] SETT variable out of range.\n");
+        }
+    }
+    else if(command == "STATE")
+    {
+        if(variable == "ON")
+        {
+            // Start sampling
+            Config config = *latestConfig();
+            config.samplingEnabled = true;
+            publishConfig(config);
 
-                // Echo confirmation string
-                serialQueue.call(serialMessage, "SD CARD: FLUSHED\n");
-            }
+            // Echo confirmation string
+            serialMessage("SAMPLING: ACTIVE\n");                
+        }
+        else if(variable == "OFF")
+        {
+            // Stop sampling (after the sample in progress)
+            Config config = *latestConfig();
+            config.samplingEnabled = false;
+            publishConfig(config);
+
+            // Echo confirmation string
+            serialMessage("SAMPLING: INACTIVE\n");
+        }
+        else
+        {
+            serialMessage("[ERROR] STATE variable must be ON or OFF.\n");
+        }
+    }
+    else if(command == "LOGGING")
+    {
+         if(variable == "ON")
+        {
+            // Start logging
+            Config config = *latestConfig();
+            config.loggingEnabled = true;
+            publishConfig(config);
+
+            // Echo confirmation string
+            serialMessage("LOGGING: ACTIVE\n");
+            
+        }
+        else if(variable == "OFF")
+        {
+            // Stop logging                
+            Config config = *latestConfig();
+            config.loggingEnabled = false;
+            publishConfig(config);
+
+            // Echo confirmation string
+            serialMessage("LOGGING: INACTIVE\n");
+        }
+        else
+        {
+            serialMessage("[ERROR] LOGGING variable must be ON or OFF.\n");
+        }
+    }
+    else if(command == "SD")
+    {
+        if(variable == "E")
+        {
+            // Flush AND eject the SD card (unmount)                
+            sdMountToggle();
+
+            // Echo confirmation string
+            serialMessage("SD CARD: FLUSHED, EJECTED\n");
+        }
+        else if(variable == "F")
+        {
+            // Flush the SD card
+            sdFlush();
+
+            // Echo confirmation string
+            serialMessage("SD CARD: FLUSHED\n");
+        }
+        else if(variable == "S")
+        {
+            // Report storage state and how much is waiting in RAM
+            serialMessage("SD CARD: " + string(storageStateNames[storageState]) + ", " + to_string(spillStore.count()) + " SPILLED, "
+                          + to_string(spillStore.dropped) + " DROPPED\n");
+        }
+        else
+        {
+            serialMessage("[ERROR] SD variable must be E, F or S.\n");
+        }
+    }
+    else if(command == "ALERT")
+    {
+        // ALERT <ADD spec|DEL n|LIST|CLEAR|STATS>
+        size_t space = variable.find(' ');
+        string action = variable.substr(0, space);
+        string args = (space == string::npos) ? "" : variable.substr(space + 1);
+
+        if(action == "ADD")
+        {
+            int number = alertEngine.add(args, schedulerClock.elapsed_time().count() / 1000);
+            if(number > 0)
+                serialMessage("ALERT RULE " + to_string(number) + " ADDED\n");
+            else if(number < 0)
+                serialMessage("[ERROR] ALERT rule table full (max " + to_string(ALERT_MAX_RULES) + ").\n");
             else
-            {
-                serialQueue.call(serialMessage, "[ERROR] SD variable must be E or F.\n");
-            }
+                serialMessage("[ERROR] ALERT ADD expects <TEMP|PRES|LIGHT> [DELTA|MEAN] <>|<> <value> [window seconds] (|value| <= " + to_string(ALERT_MAX_THRESHOLD) + ").\n");
         }
-		else if("ERRORTEST")
-		{
-			fifoBuffer.errorTest();
-		}
+        else if(action == "DEL")
+        {
+            if(alertEngine.remove(atoi(args.c_str())))
+                serialMessage("ALERT RULE " + args + " DELETED\n");
+            else
+                serialMessage("[ERROR] No such ALERT rule.\n");
+        }
+        else if(action == "LIST")
+        {
+            serialMessage(alertEngine.list());
+        }
+        else if(action == "CLEAR")
+        {
+            alertEngine.clear();
+            serialMessage("ALERT RULES: CLEARED\n");
+        }
+        else if(action == "STATS")
+        {
+            // Evaluation cost per sample against the fixed budget
+            serialMessage("ALERT EVALUATION: " + to_string(alertEngine.lastEvalUs) + "us (MAX " + to_string(alertEngine.worstEvalUs) + "us, BUDGET "
+                          + to_string(ALERT_BUDGET_US) + "us, " + to_string(alertEngine.overBudget) + " OVER)\n");
+        }
+        else
+        {
+            serialMessage("[ERROR] ALERT variable must be ADD, DEL, LIST, CLEAR or STATS.\n");
+        }
+    }
+    else if(command == "UPLINK")
+    {
+        if(variable == "OFF")
+        {
+            // Stop pushing to the collector (anything unacknowledged is discarded)
+            if(uplinkQueue.call(uplinkStop) != 0) serialMessage("UPLINK: INACTIVE\n");
+            else serialMessage("[ERROR] Uplink busy; try again.\n");
+        }
+        else if(variable == "S")
+        {
+            // Report connection state and compression
+            serialMessage(uplink.getData());
+        }
+        else if(variable.find(':') != string::npos)
+        {
+            // Push every flushed block to <host>:<port> from now on
+            if(uplinkQueue.call(uplinkStart, variable) != 0) serialMessage("UPLINK: ACTIVE (" + variable + ")\n");
+            else serialMessage("[ERROR] Uplink busy; try again.\n");
+        }
+        else
+        {
+            serialMessage("[ERROR] UPLINK variable must be <host>:<port>, OFF or S.\n");
+        }
+    }
+    else if(command == "LATENCY")
+    {
+        // Report how late the periodic events are being dispatched (scheduling latency)
+        string message = "SAMPLE LATENCY: " + to_string(sampleLatency.last.count()) + "us (MAX " + to_string(sampleLatency.worst.count()) + "us)\n"
+                       + "CLOCK LATENCY: " + to_string(clockLatency.last.count()) + "us (MAX " + to_string(clockLatency.worst.count()) + "us)\n";
+        serialMessage(message);
+    }
+    else if(command == "STACK")
+    {
+        // Report each thread's deepest stack use against its size (run after SD E, a recovery and /api/rollup/1m)
+#if defined(MBED_STACK_STATS_ENABLED)
+        mbed_stats_stack_t stacks[8];
+        int count = mbed_stats_stack_get_each(stacks, 8);
+        string message = "";
+        for(int i = 0; i < count; ++i)
+        {
+            char line[80];
+            uint32_t id = stacks[i].thread_id;
+            const char* name = (id == (uint32_t)(uintptr_t)ThisThread::get_id()) ? "main/ioQueue" : (id == (uint32_t)(uintptr_t)tRealtime.get_id()) ? "tRealtime"
+                             : (id == (uint32_t)(uintptr_t)tUplink.get_id()) ? "tUplink" : NULL;
+            if(name != NULL) snprintf(line, sizeof(line), "STACK %s: %lu OF %lu BYTES\n", name, (unsigned long)stacks[i].max_size, (unsigned long)stacks[i].reserved_size);
+            else snprintf(line, sizeof(line), "STACK 0x%08lx: %lu OF %lu BYTES\n", (unsigned long)id, (unsigned long)stacks[i].max_size, (unsigned long)stacks[i].reserved_size);
+            message += line;
+        }
+        serialMessage(message);
+#else
+        serialMessage("[ERROR] Stack statistics are not compiled in (platform.stack-stats-enabled).\n");
+#endif
+    }
+    else if(command == "LIVE")
+    {
+        if(variable == "ON" || variable == "OFF")
+        {
+            // Show/hide the latest sample on the LCD's second row
+            Config config = *latestConfig();
+            config.lcdLive = (variable == "ON");
+            publishConfig(config);
 
-        // Log as per requirement
-        concatenated = "Command parsed: " + command + " " + variable + "\n";
-        logMessage(concatenated, false);
+            // Echo confirmation string
+            serialMessage(config.lcdLive ? "LCD LIVE READOUT: ACTIVE\n" : "LCD LIVE READOUT: INACTIVE\n");
+        }
+        else
+        {
+            serialMessage("[ERROR] LIVE variable must be ON or OFF.\n");
+        }
+    }
+    else if(command == "POWER")
+    {
+        if(variable == "ON" || variable == "OFF")
+        {
+            // Switch low-power mode (sampling is re-planned around the clock tick when it's applied)
+            Config config = *latestConfig();
+            config.lowPowerMode = (variable == "ON");
+            publishConfig(config);
+
+            // Echo confirmation string
+            serialMessage(config.lowPowerMode ? "LOW POWER: ACTIVE\n" : "LOW POWER: INACTIVE\n");
+        }
+        else if(variable == "STATS")
+        {
+            // Report time spent awake per worker thread (duty cycle)
+            chrono::microseconds uptime = schedulerClock.elapsed_time();
+            string message = "UPTIME: " + to_string((unsigned long)(uptime.count() / 1000)) + "ms\n"
+                           + rtDuty.getData(uptime) + ioDuty.getData(uptime) + uplinkDuty.getData(uptime)
+                           + "DEEP SLEEP: " + (deepSleepLocked ? "LOCKED" : "ALLOWED") + " BY POWER POLICY, "
+                           + (sleep_manager_can_deep_sleep() ? "POSSIBLE NOW\n" : "BLOCKED NOW (ANOTHER DRIVER HOLDS A LOCK)\n")
+                           + (deepSleepLocked ? "" : "CONSOLE INPUT: OFF AFTER " + to_string(CONSOLE_WAKE_MS / 1000) + "s IDLE (BUTTON B WAKES IT)\n");
+#if defined(MBED_CPU_STATS_ENABLED)
+            // Cross-check against the RTOS idle accounting, when it's compiled in
+            mbed_stats_cpu_t cpuStats;
+            mbed_stats_cpu_get(&cpuStats);
+            message += "CPU: SLEEP " + to_string((unsigned long)(cpuStats.sleep_time / 1000)) + "ms, DEEP SLEEP " + to_string((unsigned long)(cpuStats.deep_sleep_time / 1000)) + "ms\n";
+#endif
+            serialMessage(message);
+        }
+        else
+        {
+            serialMessage("[ERROR] POWER variable must be ON, OFF or STATS.\n");
+        }
+    }
+    else if(command == "CONFIG")
+    {
+        if(variable == "S")
+        {
+            // Report the configuration (as it will be once any pending change is applied)
+            const Config* config = latestConfig();
+            string message = "CONFIG: V" + to_string(config->version) + (pendingConfig.load() != NULL ? " (PENDING)\n" : "\n")
+                           + "T: " + to_string(config->sampleRate) + "ms, FLUSH EVERY " + to_string(config->consumeThreshold) + " RECORDS\n"
+                           + "STATE: " + (config->samplingEnabled ? "ON" : "OFF") + ", LOGGING: " + (config->loggingEnabled ? "ON" : "OFF")
+                           + ", LIVE: " + (config->lcdLive ? "ON" : "OFF") + ", POWER: " + (config->lowPowerMode ? "ON" : "OFF") + "\n"
+                           + "STORE: " + (configStoreReady ? "READY\n" : "UNAVAILABLE\n");
+            serialMessage(message);
+        }
+        else if(variable == "RESET")
+        {
+            // Back to the defaults (persisted too, so they survive a reboot)
+            publishConfig(Config());
+            serialMessage("CONFIG: DEFAULTS RESTORED\n");
+        }
+        else
+        {
+            serialMessage("[ERROR] CONFIG variable must be S or RESET.\n");
+        }
     }
+    else if(command == "ERRORTEST")
+    {
+        fifoBuffer.errorTest();
+    }
+
+    // Log as per requirement
+    concatenated = "Command parsed: " + command + " " + variable + "\n";
+    logMessage(concatenated, false);
+
+    serialMessage("\nEnter a command (see Table 2 for details). Press ENTER to finish: \n");
 }
 
-/** Initialises onboard web page server and displays data upon user refresh
-    @note Runs on own thread tNetComm.
+/** Follows the Ethernet connection, which main() starts without blocking
+    @param event Network event
+    @param status New connection status (for NSAPI_EVENT_CONNECTION_STATUS_CHANGE)
+    @note Called on the network stack's thread, so it only queues work onto ioQueue.
 */
-void refreshServer()
+void networkStatus(nsapi_event_t event, intptr_t status)
+{
+    if(event != NSAPI_EVENT_CONNECTION_STATUS_CHANGE) return;
+
+    if(status == NSAPI_STATUS_GLOBAL_UP)
+        ioQueue.call(startServer);
+    else if(status == NSAPI_STATUS_DISCONNECTED)
+        ioQueue.call(serialMessage, "NETWORK: DISCONNECTED\n");
+}
+
+/** Initialises onboard web page server
+    @note Queued on ioQueue by networkStatus() once DHCP has given us an address; connections are then handled by refreshServer().
+    @note The interface can come up again after a dropout, but the socket only needs setting up once.
+*/
+void startServer()
 {    
-	// Initialise ethernet connection
-    ethernetInterface.connect();
+    BusyScope busy(ioDuty);
+    static bool listening = false;
 
     // Get the network address
     SocketAddress socketAddress;
@@ -740,74 +2191,140 @@ void refreshServer()
     // Retrieve and log network address
 	string ip_address = socketAddress.get_ip_address();
 	if(!ip_address.empty())
-		serialQueue.call(serialMessage, "IP Address: " + ip_address + "\n"); // Logging is OFF by default; also not a "logged" message per sé
+		serialMessage("IP Address: " + ip_address + "\n"); // Logging is OFF by default; also not a "logged" message per sé
 	else
 		logMessage("IP Address could not be retrieved.\n", true);
+
+    if(listening) return;
+    listening = true;
     
 	// Open and bind socket to port 80 (a popular port; may need changing if blocked by other programs)
-    TCPSocket socket;
-    socket.open(&ethernetInterface);
-    socket.bind(80);
+    serverSocket.open(&ethernetInterface);
+    serverSocket.bind(80);
 
     //Set socket to listening mode (up to 5 connections)
-    nsapi_error_t socketError = socket.listen(5);
+    nsapi_error_t socketError = serverSocket.listen(5);
     if(socketError != 0) 
 	{
-        socket.close();	
+        serverSocket.close();	
 		logMessage("Socket listening error ("+to_string(socketError)+")\n", true);
     }
 
-    while(true)
+    // Accept without blocking: the socket's sigio queues refreshServer() whenever a connection is waiting
+    serverSocket.set_blocking(false);
+    serverSocket.sigio(ioQueue.event(refreshServer));
+}
+
+/** Reads the path from a request line ("GET /path HTTP/1.1")
+    @param socketPtr Connected client socket
+    @return Requested path ("/" if it can't be read)
+*/
+string getRequestPath(TCPSocket* socketPtr)
+{
+    char request[128];
+    socketPtr->set_timeout(1000); // Don't let a silent client stall ioQueue
+    nsapi_size_or_error_t received = socketPtr->recv(request, sizeof(request) - 1);
+    if(received <= 0) return "/";
+    request[received] = '\0';
+
+    char path[64];
+    if(sscanf(request, "%*s %63s", path) != 1) return "/";
+    return path;
+}
+
+/** Builds the dashboard page with the current time and sensor data
+    @return HTTP response
+*/
+string getDashboard()
+{
+    // Retrieve time and sensor data
+	char* timestamp_chars = dateTime.getTimestamp();
+	string timestamp = timestamp_chars;
+	free(timestamp_chars);
+	float temp = bmp280.getTemperature();
+	float pres = bmp280.getPressure();
+	char temperature[24];
+	sprintf(temperature, "%.2f", temp);
+	char pressure[24];
+	sprintf(pressure, "%.4f", pres);
+	char light_level[24];
+	sprintf(light_level, "%.4f", (float) ldr);
+    
+    // Parse variables in HTML response 
+	// (Mustache.js, eat your heart out)
+	string html = string(HTTP_TEMPLATE);		// Stringify HTML template		
+	size_t placeholder = html.find("{{0}}");   	// Find datetime placeholder {{0}}
+    if(placeholder) 
+	{
+        html.replace(placeholder, 5, timestamp);
+    }
+	placeholder = html.find("{{1}}");   		// Find temperature placeholder {{1}}
+    if(placeholder) 
+	{
+        html.replace(placeholder, 5, temperature);
+    }
+	placeholder = html.find("{{2}}");   		// Find pressure placeholder {{2}}
+    if(placeholder) 
+	{
+        html.replace(placeholder, 5, pressure);
+    }
+	placeholder = html.find("{{3}}");   		// Find light level placeholder {{3}}
+    if(placeholder) 
+	{
+        html.replace(placeholder, 5, light_level);
+    }
+
+	return html;
+}
+
+/** Serves a rollup tier as JSON
+    @param query "<tier>" or "<tier>?last=<n>", e.g. "1h?last=24"
+    @return HTTP response (JSON)
+*/
+string getRollupJson(string query)
+{
+    size_t question = query.find('?');
+    string name = query.substr(0, question);
+    int last = 0;
+    if(question != string::npos) sscanf(query.c_str() + question, "?last=%d", &last);
+
+    for(RollupTier* tier : rollupTiers)
     {
-        TCPSocket* socketPtr = socket.accept(); // Wait until socket connection received (e.g. from browser refresh)        
+        if(name == tier->name) return string(HTTP_JSON_TEMPLATE) + tier->getJson(last);
+    }
+    return string(HTTP_JSON_TEMPLATE) + "{\"error\":\"Unknown tier\"}";
+}
 
-        // Retrieve time and sensor data
-		string timestamp = dateTime.getTimestamp();
-		float temp = bmp280.getTemperature();
-		float pres = bmp280.getPressure();
-		char temperature[24];
-		sprintf(temperature, "%.2f", temp);
-		char pressure[24];
-		sprintf(pressure, "%.4f", pres);
-		char light_level[24];
-		sprintf(light_level, "%.4f", (float) ldr);
-        
-        // Parse variables in HTML response 
-		// (Mustache.js, eat your heart out)
-		string html = string(HTTP_TEMPLATE);		// Stringify HTML template		
-		size_t placeholder = html.find("{{0}}");   	// Find datetime placeholder {{0}}
-        if(placeholder) 
-		{
-            html.replace(placeholder, 5, timestamp);
-        }
-		placeholder = html.find("{{1}}");   		// Find temperature placeholder {{1}}
-        if(placeholder) 
-		{
-            html.replace(placeholder, 5, temperature);
-        }
-		placeholder = html.find("{{2}}");   		// Find pressure placeholder {{2}}
-        if(placeholder) 
-		{
-            html.replace(placeholder, 5, pressure);
-        }
-		placeholder = html.find("{{3}}");   		// Find light level placeholder {{3}}
-        if(placeholder) 
-		{
-            html.replace(placeholder, 5, light_level);
-        }     
+/** Displays data upon user refresh, or serves /history and the JSON API
+    @note Deferred event on ioQueue, queued by the server socket's sigio.
+*/
+void refreshServer()
+{    
+    BusyScope busy(ioDuty);
+    TCPSocket* socketPtr;
+    while((socketPtr = serverSocket.accept()) != NULL) // Serve every connection received (e.g. from browser refresh) 
+    {
+        string path = getRequestPath(socketPtr);
+        string response;
+        if(path == "/api/alerts")
+            response = string(HTTP_JSON_TEMPLATE) + alertEngine.getJson();
+        else if(path.compare(0, 12, "/api/rollup/") == 0)
+            response = getRollupJson(path.substr(12));
+        else if(path == "/history")
+            response = HTTP_HISTORY_TEMPLATE;
+        else
+            response = getDashboard();
 
         // Send parsed response
-        nsapi_size_or_error_t result = socketPtr->send(html.c_str(), strlen(html.c_str()));
+        nsapi_size_or_error_t result = socketPtr->send(response.c_str(), response.length());
 		if(result <= 0)
 			logMessage("0 bytes sent through network socket.", true);
         
         socketPtr->close(); // Close socket
-
-		wait_us(1000000); // Wait 1s to prevent spam
     }
 }
 
-/** Formats messages as logged messages before sending to serialQueue.
+/** Formats messages as logged messages before sending to ioQueue.
     @param message The message to be logged.
     @param isCriticalError Whether the message is a critical error
     @note Triggers critical error if isCriticalError is true
@@ -819,35 +2336,212 @@ void logMessage(string message, bool isCriticalError)
         redLED = 1;
         error("%s", message.c_str());
     } 
-    else if(loggingEnabled)
+    else if(activeConfig.load()->loggingEnabled)
     {
         message = "[LOG] " + message;
-        serialQueue.call(serialMessage, message);
+        ioQueue.call(serialMessage, message);
     }       
 }
 
 /** Toggles mounting of SD card.
-    @note Relies on greenLED to determine current mount status.
     @note Will also flush SD card.
+    @note A card that is FAILED (retrying) is remounted immediately; one that is MOUNTING or EJECTING is left alone.
+    @note Runs on ioQueue (queued by the user button ISR, or from the "SD E" command).
 */
 void sdMountToggle()
 {	
-	if(greenLED == 0) // If unmounted, mount
+	BusyScope busy(ioDuty);
+
+	// Ignore accidental double-tapping of button
+	Kernel::Clock::time_point now = Kernel::Clock::now();
+	if(now - lastSdToggle < chrono::milliseconds(SD_DEBOUNCE_MS)) return;
+	lastSdToggle = now;
+
+	if(storageState == ABSENT || storageState == FAILED) // If unmounted, mount (immediately writes to SD card)
 	{		
-		osSignalSet(tSDWriteId, 2);		
-		semWrite.release(); // Immediately write to SD card
-   		greenLED = 1;
+		if(sdRetryEventId != 0) ioQueue.cancel(sdRetryEventId);
+		sdRetryDelay = chrono::milliseconds(SD_RETRY_MIN_MS);
+		sdMount();
 	}
-	else // If mounted, unmount
+	else if(storageState == READY) // If mounted, unmount (flushes buffer before ejecting)
 	{
-		semWrite.release();     // SD write function will flush buffer
-		tSDWrite.flags_set(1);  // Flag will end write check loop and eject SD card
+		sdEject();
 	}
-	wait_us(200000); // Wait 0.2s to prevent accidental double-tapping of button
+}
+
+
+/** Allows deep sleep only in low-power mode with a sampling period of at least 1s.
+    @note Deep sleep stops the high-speed clocks (Ethernet, serial input) so it stays locked otherwise.
+    @note BufferedSerial holds its own deep sleep lock while its RX interrupt is attached, so console input is
+          switched off CONSOLE_WAKE_MS after the mode is applied (see consoleSleep()); button B wakes it again.
+          POWER STATS reports what the sleep manager actually allows.
+    @note Runs on ioQueue (at startup and whenever a configuration is published).
+*/
+void applyPowerPolicy()
+{
+    const Config* config = latestConfig();
+    bool allowDeepSleep = config->lowPowerMode && config->sampleRate >= 1000;
+    if(allowDeepSleep && deepSleepLocked)
+    {
+        sleep_manager_unlock_deep_sleep();
+        deepSleepLocked = false;
+    }
+    else if(!allowDeepSleep && !deepSleepLocked)
+    {
+        sleep_manager_lock_deep_sleep();
+        deepSleepLocked = true;
+    }
+
+    // Console input: on for good outside low-power mode; in it, start the countdown to switching it off
+    if(deepSleepLocked && consoleSleepEventId != 0)
+    {
+        ioQueue.cancel(consoleSleepEventId);
+        consoleSleepEventId = 0;
+    }
+    if(deepSleepLocked || (consoleInputEnabled && consoleSleepEventId == 0)) consoleWake();
+}
+
+/** Switches console input on, and (in low-power mode) schedules switching it off again after CONSOLE_WAKE_MS.
+    @note Runs on ioQueue (queued by button B, and from applyPowerPolicy()).
+*/
+void consoleWake()
+{
+    BusyScope busy(ioDuty);
+    if(!consoleInputEnabled)
+    {
+        console->enable_input(true);
+        consoleInputEnabled = true;
+        serialMessage("CONSOLE: AWAKE\n");
+    }
+    if(deepSleepLocked) return; // Not in low-power mode: input stays on
+
+    if(consoleSleepEventId != 0) ioQueue.cancel(consoleSleepEventId);
+    consoleSleepEventId = ioQueue.call_in(chrono::milliseconds(CONSOLE_WAKE_MS), consoleSleep);
+}
+
+/** Switches console input off, releasing BufferedSerial's deep sleep lock.
+    @note Deferred event on ioQueue, scheduled by consoleWake() and pushed back by every keystroke (see readConsole()).
+*/
+void consoleSleep()
+{
+    BusyScope busy(ioDuty);
+    consoleSleepEventId = 0;
+    if(deepSleepLocked || !consoleInputEnabled) return;
+
+    serialMessage("CONSOLE: ASLEEP (press button B to wake)\n");
+    console->enable_input(false);
+    consoleInputEnabled = false;
+}
+
+
+/** Returns the newest configuration: the pending snapshot if one is waiting to be applied, else the active one.
+    @return Pointer to a configuration slot (do not hold it across events)
+    @note I/O thread only: it's the only writer, so neither slot can be rewritten underneath it.
+*/
+const Config* latestConfig()
+{
+    const Config* pending = pendingConfig.load();
+    return (pending != NULL) ? pending : activeConfig.load();
+}
+
+/** Publishes a new configuration snapshot, persists it, and arranges for tRealtime to apply it.
+    @param next The complete new configuration
+    @note Runs on ioQueue. Applied by applyConfig() on tRealtime, which runs between samples, so a change never lands
+          halfway through one. Queued every time: a long (or low-power) sampling period must not delay it.
+*/
+void publishConfig(const Config& next)
+{
+    // Fill a slot that is neither pending nor active. Pending is read first: applyConfig() stores the new active
+    // pointer before clearing pending, so a slot being activated is always seen as one or the other.
+    const Config* pending = pendingConfig.load();
+    const Config* active = activeConfig.load();
+    Config* slot = &configSlots[0];
+    while(slot == pending || slot == active) ++slot;
+
+    *slot = next;
+    slot->version = CONFIG_VERSION;
+    pendingConfig.store(slot); // Replaces any change that hasn't been applied yet (it was already folded into <next>)
+
+    if(rtQueue.call(applyConfig) == 0) serialMessage("[ERROR] Configuration saved but not applied (event queue full).\n");
+    applyPowerPolicy();
+
+    if(configStoreReady && configStore.set(CONFIG_KEY, slot, sizeof(Config), 0) != MBED_SUCCESS)
+    {
+        serialMessage("[ERROR] Could not save configuration.\n");
+    }
+}
+
+/** Swaps in the pending configuration, if there is one, and re-plans sampling if its schedule changed.
+    @note Event on rtQueue, queued by publishConfig().
+*/
+void applyConfig()
+{
+    const Config* next = pendingConfig.load();
+    if(next == NULL) return;
+
+    Config previous = *activeConfig.load(); // Copy: the old slot may be reused as soon as it stops being active
+    activeConfig.store(next);
+    // Fails (and leaves it for next time) if a newer one was published meanwhile. On failure the first argument is
+    // overwritten with that newer pointer, so it gets a copy: <next> must stay the configuration just activated
+    const Config* expected = next;
+    pendingConfig.compare_exchange_strong(expected, nullptr);
+
+    if(next->samplingEnabled != previous.samplingEnabled || next->sampleRate != previous.sampleRate || next->lowPowerMode != previous.lowPowerMode)
+    {
+        if(next->samplingEnabled) startSampling();
+        else stopSampling();
+    }
+}
+
+/** Loads the stored configuration and datetime, falling back to the defaults.
+    @note Runs once in main() before tRealtime starts, so nothing else is reading the configuration yet.
+*/
+void loadConfig()
+{
+    configStoreReady = (configStore.init() == MBED_SUCCESS);
+    if(!configStoreReady)
+    {
+        ioQueue.call(serialMessage, "[ERROR] Configuration store unavailable; using defaults.\n");
+        return;
+    }
+
+    Config stored;
+    size_t size = 0;
+    if(configStore.get(CONFIG_KEY, &stored, sizeof(Config), &size) == MBED_SUCCESS && size == sizeof(Config) && stored.version == CONFIG_VERSION)
+    {
+        configSlots[0] = stored;
+        ioQueue.call(serialMessage, "CONFIG: LOADED\n");
+    }
+
+    // There is no battery-backed clock: the time resumes from the last checkpoint, so say it may be behind
+    Datetime storedTime;
+    if(configStore.get(DATETIME_KEY, &storedTime, sizeof(Datetime), &size) == MBED_SUCCESS && size == sizeof(Datetime))
+    {
+        dateTime = storedTime;
+        dateTime.changePart = 0;
+        char* timestamp = dateTime.getTimestamp();
+        ioQueue.call(serialMessage, "CLOCK: RESUMED FROM " + string(timestamp) + " (BEHIND BY THE TIME SWITCHED OFF; SET THE DATE/TIME IF NEEDED)\n");
+        free(timestamp);
+    }
+}
+
+/** Saves a datetime, so the clock resumes from it after a reboot.
+    @param snapshot The datetime (taken on tRealtime, which is the only writer of dateTime)
+    @note Runs on ioQueue (every minute from displayDatetime(), and when the user finishes editing the datetime).
+*/
+void saveDatetime(Datetime snapshot)
+{
+    BusyScope busy(ioDuty);
+    snapshot.changePart = 0;
+    if(configStoreReady) configStore.set(DATETIME_KEY, &snapshot, sizeof(Datetime), 0);
 }
 
 
 /** The main thread
+    @note Becomes the ioQueue worker once everything is scheduled.
+    @note Its stack is set in mbed_app.json (rtos.main-thread-stack-size), not Mbed's default 4KB: the deepest ioQueue
+          chain (console -> SD E -> sdMount() -> rollupPersist() -> fprintf() -> FatFs -> SPI) needs more than that.
+          STACK reports the high-water mark of every thread.
 */
 int main()
 {
@@ -857,15 +2551,27 @@ int main()
 
     //Environmental sensor
     bmp280.initialize();
+    schedulerClock.start();
+    loadConfig();                                           // Settings and datetime from the last boot
     
-    // Start threads
-    tSerialComm.start(serialThread);              // Requirement 6  
-    tSample.start(sampleEnvironment);             // Requirement 1
-    tDatetime.start(displayDatetime);             // Requirement 4
-    tDatetimeChange.start(handleDatetimeChange);  // Requirement 4
-    tSDWrite.start(sdWrite);                      // Requirement 2 & 3
-    tNetComm.start(refreshServer);                // Requirement 9
-    tInput.start(getUserInput);                   // Requirement 8
-
-    btnUser.rise(&sdMountToggle);                 // Requirement 13
-}
\ No newline at end of file
+    // Periodic events
+    if(activeConfig.load()->samplingEnabled) rtQueue.call(startSampling); // Requirement 1
+    clockLatency.reset(schedulerClock.elapsed_time(), 1s);
+    rtQueue.call_every(1s, displayDatetime);                // Requirement 4
+    btnA.rise(&changePart);                                 // Requirement 4
+    tRealtime.start(callback(&rtQueue, &EventQueue::dispatch_forever)); // Requirement 6
+    tUplink.start(callback(&uplinkQueue, &EventQueue::dispatch_forever)); // Idle until an UPLINK command
+
+    // Deferred events
+    applyPowerPolicy();                                     // Deep sleep stays locked unless the loaded configuration allows it
+    ioQueue.call(sdMount);                                  // Requirement 2 & 3
+    ethernetInterface.attach(networkStatus);                // Requirement 9: starts the server once connected
+    ethernetInterface.set_blocking(false);                  // Returns straight away, so DHCP (or no cable) can't hold up ioQueue
+    ethernetInterface.connect();
+    ioQueue.call(serialMessage, "\nEnter a command (see Table 2 for details). Press ENTER to finish: \n");
+    console->sigio(ioQueue.event(readConsole));             // Requirement 8
+    btnUser.rise(ioQueue.event(sdMountToggle));             // Requirement 13
+    btnB.rise(ioQueue.event(consoleWake));                  // Low-power mode: console input is switched off to deep sleep
+
+    ioQueue.dispatch_forever();                             // Requirement 6
+}
@@ -0,0 +1,66 @@
+/** Benchmark for AlertEngine: evaluates a full ALERT_MAX_RULES table and checks the per-sample cost against ALERT_BUDGET_US
+    @note The table mixes every rule kind, with windows from 10s to a day. Samples arrive every second, with a gap
+          longer than every window now and then (the worst case: each rule retires all ALERT_BUCKETS buckets at once).
+    @note The PC is much faster than the board, so this catches regressions in the algorithm (e.g. work growing with the
+          window or the sample rate) rather than proving the board's timing; the board counts samples over budget
+          itself (ALERT STATS).
+    @note Usage: bench_alert_engine [samples]
+*/
+#include "AlertEngine.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+// BenchSample struct: stand-in for SensorData
+struct BenchSample
+{
+    float temperature, pressure, lightLevel;
+};
+
+int main(int argc, char** argv)
+{
+    int samples = (argc > 1) ? atoi(argv[1]) : 200000;
+
+    AlertEngine<BenchSample> engine;
+    const char* specs[] = { "TEMP > 25", "PRES < 980", "TEMP DELTA > 2 600", "PRES DELTA < -3 3600",
+                            "LIGHT DELTA > 0.3 10", "TEMP MEAN > 24 86400", "PRES MEAN < 990 1800", "LIGHT MEAN < 0.1 60" };
+    for(const char* spec : specs)
+    {
+        if(engine.add(spec, 0) <= 0)
+        {
+            printf("Could not add rule \"%s\"\n", spec);
+            return 1;
+        }
+    }
+    if(engine.add("TEMP > 0", 0) != -1)
+    {
+        printf("Rule table is larger than the benchmark (ALERT_MAX_RULES %d)\n", ALERT_MAX_RULES);
+        return 1;
+    }
+
+    std::vector<uint32_t> costs;
+    costs.reserve(samples);
+    std::string reports = "";
+    uint32_t nowMs = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < samples; ++i)
+    {
+        nowMs += (i % 5000 == 4999) ? 90000000 : 1000; // Every 5000 samples, a gap longer than a day
+        BenchSample sample = { 20.0f + 5.0f * sinf(i * 0.001f), 1000.0f + 20.0f * cosf(i * 0.0003f), 0.5f + 0.4f * sinf(i * 0.01f) };
+        engine.evaluate(sample, nowMs, &reports);
+        costs.push_back(engine.lastEvalUs);
+        if(reports.size() > 4096) reports.clear(); // Reports would be queued to the console on the board
+    }
+    double totalUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(costs.begin(), costs.end());
+    uint32_t p99 = costs[(size_t)(costs.size() * 0.99)];
+    printf("%d samples, %d rules: mean %.3fus, p99 %uus, max %uus per sample (budget %dus)\n", samples, ALERT_MAX_RULES,
+           totalUs / samples, p99, costs.back(), ALERT_BUDGET_US);
+
+    // The mean and p99 are what the budget is about; a single max can be the PC's scheduler, not the engine
+    bool ok = (totalUs / samples <= ALERT_BUDGET_US) && (p99 <= ALERT_BUDGET_US);
+    printf("%s\n", ok ? "Within budget" : "OVER BUDGET");
+    return ok ? 0 : 1;
+}
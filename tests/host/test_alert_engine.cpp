@@ -0,0 +1,157 @@
+/** Host test for AlertEngine: rule parsing, threshold edges, DELTA/MEAN windows, window expiry and sampling gaps
+    @note Time is simulated: each sample is fed with the scheduler time (in ms) it would have been taken at.
+    @note Usage: test_alert_engine
+*/
+#include "AlertEngine.h"
+#include <cstdlib>
+#include <string>
+
+// TestSample struct: stand-in for SensorData
+struct TestSample
+{
+    float temperature = 20.0f, pressure = 1000.0f, lightLevel = 0.5f;
+};
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if(condition) return;
+    printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+static bool contains(const std::string& text, const char* part)
+{
+    return text.find(part) != std::string::npos;
+}
+
+/** Feeds <value> to every metric of the engine from <fromMs> to <toMs> (exclusive) every <stepMs>
+    @return Reports produced
+*/
+static std::string feed(AlertEngine<TestSample>& engine, float value, uint32_t fromMs, uint32_t toMs, uint32_t stepMs = 1000)
+{
+    std::string reports = "";
+    TestSample sample;
+    sample.temperature = sample.pressure = sample.lightLevel = value;
+    for(uint32_t t = fromMs; t < toMs; t += stepMs) engine.evaluate(sample, t, &reports);
+    return reports;
+}
+
+/** Feeds <value> until a report appears
+    @return Time of the sample that produced it, or 0 if none did before <toMs>
+*/
+static uint32_t feedUntilReport(AlertEngine<TestSample>& engine, float value, uint32_t fromMs, uint32_t toMs, uint32_t stepMs = 1000)
+{
+    for(uint32_t t = fromMs; t < toMs; t += stepMs)
+    {
+        if(!feed(engine, value, t, t + 1).empty()) return t;
+    }
+    return 0;
+}
+
+static void testParsing()
+{
+    AlertEngine<TestSample> engine;
+    check(engine.add("TEMP > 25", 0) == 1, "threshold rule is accepted");
+    check(engine.add("PRES DELTA < -3 600", 0) == 2, "DELTA rule is accepted");
+    check(engine.add("LIGHT MEAN > 0.8 60", 0) == 3, "MEAN rule is accepted");
+    check(engine.add("HUMIDITY > 5", 0) == 0, "unknown metric is rejected");
+    check(engine.add("TEMP = 5", 0) == 0, "unknown operator is rejected");
+    check(engine.add("TEMP SUM > 5 60", 0) == 0, "unknown kind is rejected");
+    check(engine.add("TEMP DELTA > 5 0", 0) == 0, "zero window is rejected");
+    check(engine.add("TEMP DELTA > 5 86401", 0) == 0, "window over a day is rejected");
+    check(engine.add("TEMP > nan", 0) == 0, "NaN threshold is rejected");
+    check(engine.add("TEMP > inf", 0) == 0, "infinite threshold is rejected");
+    check(engine.add("TEMP > 1e30", 0) == 0, "threshold beyond ALERT_MAX_THRESHOLD is rejected");
+    check(contains(engine.list(), "2 PRES DELTA < -3.00 600"), "rules list as entered");
+
+    for(int i = 3; i < ALERT_MAX_RULES; ++i) engine.add("TEMP < 0", 0);
+    check(engine.add("TEMP < 0", 0) == -1, "full table is reported");
+    check(engine.remove(2) && !engine.remove(2), "remove reports whether the rule existed");
+    check(engine.add("TEMP < 0", 0) == 2, "a removed rule's slot is reused");
+    engine.clear();
+    check(engine.list() == "No alert rules\n", "clear removes every rule");
+}
+
+static void testThreshold()
+{
+    AlertEngine<TestSample> engine;
+    engine.add("TEMP > 25", 0);
+    check(feed(engine, 24.0f, 0, 5000).empty(), "threshold: no report below");
+    std::string reports = feed(engine, 26.0f, 5000, 6000);
+    check(contains(reports, "[ALERT] RULE 1 (TEMP > 25.00) TRIGGERED: 26.00"), "threshold: triggers above");
+    check(feed(engine, 27.0f, 6000, 20000).empty(), "threshold: a sustained condition is reported once");
+    check(contains(feed(engine, 20.0f, 20000, 21000), "CLEARED"), "threshold: clears below");
+    check(contains(engine.list(), "INACTIVE, LAST 20.00, TRIGGERED 1"), "threshold: trigger count");
+}
+
+static void testDelta()
+{
+    // 30s window, 1s buckets: ready once 29 buckets have completed
+    AlertEngine<TestSample> engine;
+    engine.add("PRES DELTA < -3 30", 0);
+    check(feed(engine, 1000.0f, 0, 5000).empty(), "DELTA: steady before ready");
+    check(feed(engine, 990.0f, 5000, 6000).empty(), "DELTA: no trigger before the window has filled");
+    feed(engine, 1000.0f, 6000, 40000);
+
+    // Now drop by 4: the oldest bucket holds 1000
+    check(contains(feed(engine, 996.0f, 40000, 41000), "TRIGGERED: -4.00"), "DELTA: triggers on a drop against the oldest bucket");
+
+    // Hold 996: once the drop is older than the window the change is 0 again
+    uint32_t cleared = feedUntilReport(engine, 996.0f, 41000, 80000);
+    check(cleared >= 69000 && cleared <= 71000, "DELTA: clears once the drop leaves the window");
+
+    // A rise doesn't trigger a "<" rule
+    check(feed(engine, 1010.0f, 80000, 90000).empty(), "DELTA: a rise doesn't trigger a fall rule");
+}
+
+static void testMean()
+{
+    // 10s window, 333ms buckets, 100ms sampling
+    AlertEngine<TestSample> engine;
+    engine.add("TEMP MEAN > 25 10", 0);
+    check(feed(engine, 30.0f, 0, 9000, 100).empty(), "MEAN: no trigger before the window has filled");
+    check(contains(feed(engine, 30.0f, 9000, 11000, 100), "TRIGGERED: 30.00"), "MEAN: triggers once the window has filled");
+    feed(engine, 30.0f, 11000, 20000, 100);
+
+    // Switch to 20: the mean crosses 25 about half a window later, and old samples drop out of it
+    uint32_t cleared = feedUntilReport(engine, 20.0f, 20000, 40000, 100);
+    check(cleared >= 24000 && cleared <= 26000, "MEAN: clears about half a window after the switch");
+    feed(engine, 20.0f, 40000, 41000, 100);
+    check(contains(engine.list(), "LAST 20.00"), "MEAN: the window only holds recent samples");
+}
+
+static void testGaps()
+{
+    // A gap longer than the window retires every bucket: DELTA has nothing to compare against
+    // (sampling every 100ms, so every 333ms bucket of the 10s windows gets samples)
+    AlertEngine<TestSample> delta;
+    delta.add("TEMP DELTA > 5 10", 0);
+    feed(delta, 20.0f, 0, 12000, 100);
+    check(feed(delta, 30.0f, 72000, 84000, 100).empty(), "gap: DELTA doesn't compare against samples from before the gap");
+    check(contains(delta.list(), "LAST 0.00, TRIGGERED 0"), "gap: DELTA is relative to post-gap samples once the window refills");
+
+    // ...and MEAN only averages what is left
+    AlertEngine<TestSample> mean;
+    mean.add("TEMP MEAN > 25 10", 0);
+    check(contains(feed(mean, 30.0f, 0, 12000, 100), "TRIGGERED"), "gap: MEAN triggers before the gap");
+    check(contains(feed(mean, 20.0f, 72000, 72100, 100), "CLEARED: 20.00"), "gap: MEAN forgets samples from before the gap");
+
+    // A gap shorter than the window keeps the older buckets
+    AlertEngine<TestSample> shortGap;
+    shortGap.add("TEMP DELTA > 5 10", 0);
+    feed(shortGap, 20.0f, 0, 12000, 100);
+    check(contains(feed(shortGap, 30.0f, 16000, 16100, 100), "TRIGGERED: 10.00"), "gap: DELTA still compares across a short gap");
+}
+
+int main()
+{
+    testParsing();
+    testThreshold();
+    testDelta();
+    testMean();
+    testGaps();
+    printf("%s\n", (failures == 0) ? "All alert engine checks passed" : "Alert engine checks failed");
+    return (failures == 0) ? 0 : 1;
+}
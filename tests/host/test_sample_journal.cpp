@@ -0,0 +1,358 @@
+/** Host test for SampleJournal: power cuts at random points must neither lose nor duplicate committed samples
+    @note Each trial runs a few "boots". A boot replays the journal, then samples and flushes blocks with the same
+          journal protocol as sdFlush() and stops at a random operation. The bytes that operation wrote are then cut
+          at a random length (a torn write), and sometimes a byte in the torn part is corrupted.
+    @note The card can also be missing at boot, or fail mid-block: samples then spill to RAM (as spillStore) and the
+          remount passes the newest spilled sequence to open() as <heldThrough>, then writes a catch-up block.
+    @note After the last boot, data.txt must hold every committed sample exactly once, in order. A second recovery
+          must leave it unchanged.
+    @note Usage: test_sample_journal [trials] [seed]
+*/
+#include "SampleJournal.h"
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#define TEST_JOURNAL_PATH "journal.bin"
+#define TEST_DATA_PATH    "data.txt"
+#define TEST_COMPACT_AT   24    // Small, so compaction is torn as well
+
+// Minimal stand-ins for Datetime, SensorData and FIFOBuffer::BufferData
+struct TestDatetime
+{
+    unsigned short year = 2021;
+    char month = 1, day = 1;
+    unsigned short hour = 0, minute = 0, second = 0;
+};
+
+struct TestSensorData
+{
+    float temperature = 0.0f, pressure = 0.0f, lightLevel = 0.0f;
+};
+
+// TestRecord struct: a sample whose data.txt line identifies it ("<boot> <sequence>")
+struct TestRecord
+{
+    TestDatetime dateTime;
+    TestSensorData sensorData;  // Boot number in <lightLevel>, sequence in <pressure> (floats hold both exactly)
+    uint32_t sequence = 0;
+
+    std::string getData()
+    {
+        char line[32];
+        snprintf(line, sizeof(line), "%ld %ld\n", lroundf(sensorData.lightLevel), lroundf(sensorData.pressure));
+        return line;
+    }
+};
+
+// Sample identity: (boot, sequence)
+typedef std::pair<long, long> SampleId;
+
+static long fileSize(const char* path)
+{
+    struct stat info;
+    return (stat(path, &info) == 0) ? (long)info.st_size : 0;
+}
+
+/** Board class plays the firmware's part: journal every sample, then write blocks to data.txt under INTENT/CHECKPOINT
+*/
+class Board
+{
+    SampleJournal<TestRecord> journal;
+    FILE* data = NULL;
+    std::vector<TestRecord> buffer;     // Not yet in data.txt (journaled while mounted)
+    std::vector<TestRecord> spill;      // Taken out of <buffer> while the card was unusable; written first on remount
+    uint32_t nextSequence = 1;
+    long boot;
+
+    public:
+        long journalBefore = 0, dataBefore = 0;     // File sizes before the most recent operation
+        std::vector<SampleId> lastAppended;
+
+        Board(long bootNumber) : journal(TEST_JOURNAL_PATH, TEST_COMPACT_AT), boot(bootNumber) {}
+
+        /** Mounts: opens data.txt and recovers from the journal (as sdMount(), before its catch-up flush)
+            @return Samples recovered, or -1 on error
+        */
+        int mount()
+        {
+            data = fopen(TEST_DATA_PATH, "a");
+            if(data == NULL) return -1;
+            int recovered = journal.open(data, spill.empty() ? 0 : spill.back().sequence);
+            begin();
+            return recovered;
+        }
+
+        bool isMounted()
+        {
+            return data != NULL;
+        }
+
+        /** Produces <n> samples and commits them to the journal (as journalSync()), or spills them while unmounted
+            @return Whether the samples were journaled (committed)
+        */
+        bool sample(int n)
+        {
+            begin();
+            std::vector<TestRecord> records(n);
+            lastAppended.clear();
+            for(TestRecord& record : records)
+            {
+                record.sequence = nextSequence++;
+                record.sensorData.pressure = record.sequence;
+                record.sensorData.lightLevel = boot;
+                (isMounted() ? buffer : spill).push_back(record);
+                lastAppended.push_back(SampleId(boot, record.sequence));
+            }
+            if(!isMounted()) return false;
+            journal.append(records.data(), n);
+            return true;
+        }
+
+        /** Marks where the next block (spill, then buffer) starts (first part of sdFlush())
+            @return False if there is nothing to flush
+        */
+        bool beginBlock()
+        {
+            if(buffer.empty() && spill.empty()) return false;
+            begin();
+            fseek(data, 0, SEEK_END);
+            journal.beginBlock(lastSequence(), ftell(data));
+            return true;
+        }
+
+        /** Writes the block to data.txt (middle of sdFlush())
+        */
+        void writeBlock()
+        {
+            begin();
+            for(TestRecord& record : spill) fputs(record.getData().c_str(), data);
+            for(TestRecord& record : buffer) fputs(record.getData().c_str(), data);
+            fflush(data);
+            fsync(fileno(data));
+        }
+
+        /** Checkpoints the block (end of sdFlush())
+        */
+        void endBlock()
+        {
+            begin();
+            journal.endBlock(lastSequence());
+            buffer.clear();
+            spill.clear();
+        }
+
+        /** The block write fails part way: the torn lines stay in data.txt, everything goes to the spill and the card is
+            torn down (as sdFlush()'s failure path and sdFail())
+        */
+        void failBlock(std::mt19937& random)
+        {
+            begin();
+            int lines = (int)(random() % (spill.size() + buffer.size() + 1));
+            for(TestRecord& record : spill) if(lines-- > 0) fputs(record.getData().c_str(), data);
+            for(TestRecord& record : buffer) if(lines-- > 0) fputs(record.getData().c_str(), data);
+            fflush(data);
+            fsync(fileno(data));
+            spill.insert(spill.end(), buffer.begin(), buffer.end());
+            buffer.clear();
+            unmount();
+        }
+
+        /** Power cut: everything synced is on disk; nothing else happens
+        */
+        void cut()
+        {
+            unmount();
+        }
+
+    private:
+        void begin()
+        {
+            journalBefore = fileSize(TEST_JOURNAL_PATH);
+            dataBefore = fileSize(TEST_DATA_PATH);
+        }
+
+        void unmount()
+        {
+            journal.close();
+            if(data != NULL) fclose(data);
+            data = NULL;
+        }
+
+        uint32_t lastSequence()
+        {
+            return buffer.empty() ? spill.back().sequence : buffer.back().sequence;
+        }
+};
+
+/** Tears the most recent write to <path>: cuts the bytes it wrote at a random length, maybe corrupting one of them
+    @param before File size before the write
+*/
+static void tear(const char* path, long before, std::mt19937& random)
+{
+    long after = fileSize(path);
+    if(after == before) return;
+    long from = (after < before) ? 0 : before;      // Shrunk: the file was rewritten (journal compaction)
+    long length = from + (long)(random() % (after - from + 1));
+    if(truncate(path, length) != 0) return;
+
+    if(length > from && random() % 3 == 0)
+    {
+        FILE* fp = fopen(path, "r+b");
+        if(fp == NULL) return;
+        long position = from + (long)(random() % (length - from));
+        fseek(fp, position, SEEK_SET);
+        int byte = fgetc(fp);
+        fseek(fp, position, SEEK_SET);
+        fputc(byte ^ (1 + random() % 255), fp);
+        fclose(fp);
+    }
+}
+
+static std::vector<SampleId> readData()
+{
+    std::vector<SampleId> samples;
+    FILE* fp = fopen(TEST_DATA_PATH, "r");
+    if(fp == NULL) return samples;
+    long boot, sequence;
+    while(fscanf(fp, "%ld %ld", &boot, &sequence) == 2) samples.push_back(SampleId(boot, sequence));
+    fclose(fp);
+    return samples;
+}
+
+/** Runs one trial
+    @return Whether data.txt held every committed sample exactly once, in order, and recovery was repeatable
+*/
+static bool runTrial(int trial, std::mt19937& random)
+{
+    remove(TEST_JOURNAL_PATH);
+    remove(TEST_DATA_PATH);
+
+    std::set<SampleId> committed;   // Samples whose journal append completed before a power cut
+    std::set<SampleId> produced;
+    int boots = 1 + random() % 3;
+    for(long boot = 1; boot <= boots; ++boot)
+    {
+        // Sometimes the card is missing at boot, so the first mount has spilled samples (and an old boot's journal)
+        Board board(boot);
+        if(random() % 3 != 0 && board.mount() < 0)
+        {
+            printf("Trial %d: journal could not be opened (boot %ld)\n", trial, boot);
+            return false;
+        }
+
+        // Sample, flush, fail and remount until the power is cut in the middle of a random operation
+        int operations = 1 + random() % 40;
+        for(int i = 0; i < operations; ++i)
+        {
+            bool last = (i + 1 == operations);
+            int action = random() % 8;
+            if(!board.isMounted() && action < 3)
+            {
+                // Remount, then catch up (as sdMount()); the cut can land in any step
+                if(board.mount() < 0)
+                {
+                    printf("Trial %d: journal could not be reopened (boot %ld)\n", trial, boot);
+                    return false;
+                }
+                int step = last ? random() % 4 : 3;
+                if(step >= 1 && board.beginBlock())
+                {
+                    if(step >= 2) board.writeBlock();
+                    if(step >= 3) board.endBlock();
+                }
+            }
+            else if(board.isMounted() && action < 2 && board.beginBlock())
+            {
+                int step = last ? 1 + random() % 3 : 3; // The cut can land in any step of the block
+                if(step >= 2) board.writeBlock();
+                if(step >= 3) board.endBlock();
+            }
+            else if(board.isMounted() && action == 2 && board.beginBlock())
+            {
+                board.failBlock(random);
+            }
+            else
+            {
+                bool journaled = board.sample(1 + random() % 4);
+                produced.insert(board.lastAppended.begin(), board.lastAppended.end());
+                if(journaled && !last) committed.insert(board.lastAppended.begin(), board.lastAppended.end());
+            }
+        }
+
+        board.cut();
+        tear(TEST_JOURNAL_PATH, board.journalBefore, random);
+        tear(TEST_DATA_PATH, board.dataBefore, random);
+    }
+
+    // Recover once more, then check data.txt
+    Board recovery(boots + 1);
+    if(recovery.mount() < 0)
+    {
+        printf("Trial %d: journal could not be opened for recovery\n", trial);
+        return false;
+    }
+    recovery.cut();
+    std::vector<SampleId> samples = readData();
+
+    bool ok = true;
+    for(size_t i = 1; i < samples.size(); ++i)
+    {
+        if(!(samples[i - 1] < samples[i]))
+        {
+            printf("Trial %d: out of order or duplicated: %ld/%ld then %ld/%ld\n", trial,
+                   samples[i - 1].first, samples[i - 1].second, samples[i].first, samples[i].second);
+            ok = false;
+        }
+    }
+    std::set<SampleId> present(samples.begin(), samples.end());
+    for(const SampleId& id : committed)
+    {
+        if(present.count(id) == 0)
+        {
+            printf("Trial %d: committed sample %ld/%ld lost\n", trial, id.first, id.second);
+            ok = false;
+        }
+    }
+    for(const SampleId& id : present)
+    {
+        if(produced.count(id) == 0)
+        {
+            printf("Trial %d: sample %ld/%ld was never produced\n", trial, id.first, id.second);
+            ok = false;
+        }
+    }
+
+    // Recovering again must be a no-op
+    Board again(boots + 2);
+    if(again.mount() < 0) return false;
+    again.cut();
+    if(readData() != samples)
+    {
+        printf("Trial %d: second recovery changed data.txt\n", trial);
+        ok = false;
+    }
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    int trials = (argc > 1) ? atoi(argv[1]) : 300;
+    unsigned int seed = (argc > 2) ? (unsigned int)strtoul(argv[2], NULL, 10) : 2004;
+    std::mt19937 random(seed);
+
+    int failures = 0;
+    for(int trial = 0; trial < trials; ++trial)
+    {
+        if(!runTrial(trial, random)) ++failures;
+    }
+    remove(TEST_JOURNAL_PATH);
+    remove(TEST_DATA_PATH);
+
+    printf("%d/%d trials passed (seed %u)\n", trials - failures, trials, seed);
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,331 @@
+#!/usr/bin/env python3
+"""Stand-in collector for the board's sample uplink (see the Uplink class in main.cpp).
+
+Accepts HELLO/DATA frames from any number of boards, ACKs the last sequence held for each board + boot, and reports
+the ingest rate per board and in total.
+
+    collector.py [--port 5000] [--csv samples.csv]      serve real boards (UPLINK <this host>:5000 on each)
+    collector.py --simulate 8                           serve simulated boards that drop their connection and
+                                                        reboot at random; exits non-zero if any sample is lost,
+                                                        duplicated or decoded wrongly
+
+Protocol (all integers little-endian):
+    board -> collector  HELLO  'H', uint8 length, board ID, uint32 boot ID
+    collector -> board  ACK    'A', uint32 last sequence held for this board ID + boot ID (0 if none)
+    board -> collector  DATA   'D', uint32 first sequence, uint16 record count, uint16 payload length, payload
+    collector -> board  ACK    'A', uint32 last sequence held
+Payload: per record, zigzag varints of the change from the previous record (the first record is relative to
+<first sequence> and zeros) in sequence, seconds since 2000, temperature (0.01C), pressure (0.01mBar) and
+light (0.0001V).
+"""
+import argparse
+import asyncio
+import random
+import struct
+import sys
+import time
+
+BLOCK_RECORDS = 120     # UPLINK_BLOCK_RECORDS
+FIELDS = 5              # sequence, seconds, temperature, pressure, light
+
+
+def put_varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        out.append(byte | (0x80 if value else 0))
+        if not value:
+            return bytes(out)
+
+
+def put_delta(current, previous):
+    delta = current - previous
+    return put_varint(((delta << 1) ^ (delta >> 63)) & 0xFFFFFFFFFFFFFFFF)
+
+
+def get_varint(data, offset):
+    value, shift = 0, 0
+    while True:
+        if offset >= len(data) or shift > 63:
+            raise ValueError("truncated varint")
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, offset
+
+
+def decode_payload(first, count, payload):
+    """Returns the records in a DATA payload as (sequence, seconds, temperature, pressure, light) tuples of integers."""
+    records, previous, offset = [], [first, 0, 0, 0, 0], 0
+    for _ in range(count):
+        current = []
+        for j in range(FIELDS):
+            zigzag, offset = get_varint(payload, offset)
+            current.append(previous[j] + ((zigzag >> 1) ^ -(zigzag & 1)))
+        records.append(tuple(current))
+        previous = current
+    if offset != len(payload):
+        raise ValueError("payload length mismatch")
+    return records
+
+
+def encode_block(records):
+    """Encodes records as a DATA frame, as Uplink::encodeBlock() does."""
+    payload, previous = bytearray(), [records[0][0], 0, 0, 0, 0]
+    for record in records:
+        for j in range(FIELDS):
+            payload += put_delta(record[j], previous[j])
+        previous = list(record)
+    return b"D" + struct.pack("<IHH", records[0][0], len(records), len(payload)) + payload
+
+
+class Stream:
+    """What the collector holds for one board + boot."""
+
+    def __init__(self):
+        self.last = 0           # Last contiguous sequence held
+        self.records = 0
+        self.gaps = 0           # Sequences skipped (records the board dropped because its backlog was full)
+        self.duplicates = 0     # Records re-sent after a lost ACK (expected, and discarded)
+        self.held = []          # Decoded records, when kept (simulation)
+
+
+class Collector:
+    def __init__(self, keep=False, csv=None):
+        self.streams = {}
+        self.keep = keep
+        self.csv = csv
+        self.bytes = 0
+        self.connections = 0
+        self.errors = 0
+
+    async def serve(self, reader, writer):
+        self.connections += 1
+        try:
+            header = await reader.readexactly(2)
+            if header[0:1] != b"H":
+                raise ValueError("expected HELLO")
+            board = (await reader.readexactly(header[1])).decode("ascii", "replace")
+            boot, = struct.unpack("<I", await reader.readexactly(4))
+            stream = self.streams.setdefault((board, boot), Stream())
+            self.bytes += 2 + header[1] + 4
+            writer.write(b"A" + struct.pack("<I", stream.last))
+            await writer.drain()
+
+            while True:
+                header = await reader.readexactly(9)
+                if header[0:1] != b"D":
+                    raise ValueError("expected DATA")
+                first, count, length = struct.unpack("<IHH", header[1:])
+                payload = await reader.readexactly(length)
+                self.bytes += 9 + length
+                for record in decode_payload(first, count, payload):
+                    self.hold(board, boot, stream, record)
+                writer.write(b"A" + struct.pack("<I", stream.last))
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass                # Board went away; it resumes from the last ACK on reconnect
+        except ValueError as error:
+            self.errors += 1
+            print("collector: bad frame: %s" % error, file=sys.stderr)
+        finally:
+            writer.close()
+
+    def hold(self, board, boot, stream, record):
+        sequence = record[0]
+        if sequence <= stream.last:
+            stream.duplicates += 1
+            return
+        stream.gaps += sequence - stream.last - 1
+        stream.last = sequence
+        stream.records += 1
+        if self.keep:
+            stream.held.append(record)
+        if self.csv is not None:
+            self.csv.write("%s,%u,%u,%u,%.2f,%.2f,%.4f\n" % (board, boot, sequence, record[1],
+                                                             record[2] / 100.0, record[3] / 100.0, record[4] / 10000.0))
+
+    def report(self, elapsed, previous):
+        """Prints the ingest rate per board and in total since the previous report."""
+        total = 0
+        for (board, boot), stream in sorted(self.streams.items()):
+            rate = (stream.records - previous.get((board, boot), 0)) / elapsed
+            total += rate
+            print("  %s boot %08x: %6d records, last %6d, %7.1f rec/s, %d gaps, %d duplicates"
+                  % (board, boot, stream.records, stream.last, rate, stream.gaps, stream.duplicates))
+        records = sum(s.records for s in self.streams.values())
+        print("  total: %d boards, %d records, %.1f rec/s, %.2f bytes/record, %d connections"
+              % (len({b for b, _ in self.streams}), records, total, self.bytes / records if records else 0.0,
+                 self.connections))
+        sys.stdout.flush()
+        return {key: stream.records for key, stream in self.streams.items()}
+
+
+async def report_every(collector, interval):
+    previous, last = {}, time.monotonic()
+    while True:
+        await asyncio.sleep(interval)
+        now = time.monotonic()
+        print("[%s]" % time.strftime("%H:%M:%S"))
+        previous = collector.report(now - last, previous)
+        last = now
+
+
+class SimulatedBoard:
+    """Produces samples like the firmware and pushes them like Uplink::flush(), dropping the connection (sometimes
+    mid-frame or before the ACK) and rebooting at random."""
+
+    def __init__(self, index, port, rng, records, drop_rate, reboot_rate):
+        self.board = "02:00:00:00:%02x:%02x" % (index >> 8, index & 0xFF)
+        self.port = port
+        self.rng = rng
+        self.remaining = records
+        self.drop_rate = drop_rate
+        self.reboot_rate = reboot_rate
+        self.produced = {}      # boot -> records produced that boot (sequences 1..n)
+        self.acked = {}         # boot -> last sequence the collector ACKed that boot
+        self.boot()
+
+    def boot(self):
+        self.boot_id = self.rng.getrandbits(32)
+        while self.boot_id in self.produced:
+            self.boot_id = self.rng.getrandbits(32)
+        self.produced[self.boot_id] = []
+        self.acked[self.boot_id] = 0
+        self.sequence = 0
+        self.seconds = self.rng.randrange(600000000, 800000000)
+        self.values = [self.rng.randrange(1500, 3000), self.rng.randrange(95000, 105000), self.rng.randrange(0, 33000)]
+        self.backlog = []
+
+    def sample(self, n):
+        for _ in range(min(n, self.remaining)):
+            self.sequence += 1
+            self.seconds += 1
+            self.values = [v + self.rng.randint(-3, 3) for v in self.values]
+            record = (self.sequence, self.seconds, *self.values)
+            self.produced[self.boot_id].append(record)
+            self.backlog.append(record)
+            self.remaining -= 1
+
+    async def read_ack(self, reader):
+        frame = await reader.readexactly(5)
+        if frame[0:1] != b"A":
+            raise ValueError("expected ACK")
+        return struct.unpack("<I", frame[1:])[0]
+
+    def acknowledge(self, sequence):
+        self.acked[self.boot_id] = max(self.acked[self.boot_id], sequence)
+        self.backlog = [r for r in self.backlog if r[0] > sequence]
+
+    async def run(self):
+        writer = None
+        while self.remaining > 0 or self.backlog:
+            self.sample(self.rng.randint(1, 2 * BLOCK_RECORDS))
+            if self.rng.random() < self.reboot_rate:
+                # Power cut: anything unacknowledged is gone with the RAM (the SD card keeps it, not the uplink)
+                if writer is not None:
+                    writer.close()
+                    writer = None
+                self.boot()
+                continue
+            try:
+                if writer is None:
+                    reader, writer = await asyncio.open_connection("127.0.0.1", self.port)
+                    writer.write(b"H" + bytes([len(self.board)]) + self.board.encode() + struct.pack("<I", self.boot_id))
+                    self.acknowledge(await self.read_ack(reader))
+                while self.backlog:
+                    frame = encode_block(self.backlog[:BLOCK_RECORDS])
+                    if self.rng.random() < self.drop_rate:
+                        writer.write(frame[:self.rng.randrange(len(frame) + 1)])    # Cut anywhere, even after the frame
+                        await writer.drain()
+                        raise ConnectionResetError()
+                    writer.write(frame)
+                    sequence = await self.read_ack(reader)
+                    if sequence < self.backlog[min(BLOCK_RECORDS, len(self.backlog)) - 1][0]:
+                        raise ValueError("collector ACKed %d, short of the frame" % sequence)
+                    self.acknowledge(sequence)
+            except (asyncio.IncompleteReadError, ConnectionError):
+                if writer is not None:
+                    writer.close()
+                writer = None
+            await asyncio.sleep(0)
+        if writer is not None:
+            writer.close()
+
+
+async def simulate(args):
+    collector = Collector(keep=True)
+    server = await asyncio.start_server(collector.serve, "127.0.0.1", 0)
+    port = server.sockets[0].getsockname()[1]
+    rng = random.Random(args.seed)
+    boards = [SimulatedBoard(i, port, random.Random(rng.getrandbits(64)), args.records, args.drop_rate, args.reboot_rate)
+              for i in range(args.simulate)]
+
+    start = time.monotonic()
+    await asyncio.gather(*(board.run() for board in boards))
+    await asyncio.sleep(0.1)    # Let the last ACKed frames' handlers finish
+    elapsed = time.monotonic() - start
+    server.close()
+    await server.wait_closed()
+
+    print("Simulated %d boards for %.2fs (seed %d):" % (len(boards), elapsed, args.seed))
+    collector.report(elapsed, {})
+
+    # Every ACKed record must be held, exactly as produced, once and in order. A reboot may lose records that were
+    # never ACKed, and the collector may still hold a few of them (the frame arrived, the ACK didn't)
+    failures = collector.errors
+    for board in boards:
+        for boot, produced in board.produced.items():
+            stream = collector.streams.get((board.board, boot), Stream())
+            if stream.held != produced[:len(stream.held)] or stream.last < board.acked[boot]:
+                failures += 1
+                print("FAIL %s boot %08x: held %d records, ACKed %d, produced %d"
+                      % (board.board, boot, len(stream.held), board.acked[boot], len(produced)))
+            if stream.gaps:
+                failures += 1
+                print("FAIL %s boot %08x: %d gaps" % (board.board, boot, stream.gaps))
+    print("%s" % ("PASS" if failures == 0 else "%d failures" % failures))
+    return 0 if failures == 0 else 1
+
+
+async def serve(args):
+    csv = open(args.csv, "a") if args.csv else None
+    collector = Collector(csv=csv)
+    server = await asyncio.start_server(collector.serve, args.host, args.port)
+    print("Collector listening on %s:%d" % (args.host, args.port))
+    sys.stdout.flush()
+    try:
+        async with server:
+            await asyncio.gather(server.serve_forever(), report_every(collector, args.report))
+    finally:
+        if csv is not None:
+            csv.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=5000)
+    parser.add_argument("--report", type=float, default=5.0, help="seconds between ingest reports")
+    parser.add_argument("--csv", help="append every record held to this file")
+    parser.add_argument("--simulate", type=int, metavar="BOARDS", help="run simulated boards against a local collector")
+    parser.add_argument("--records", type=int, default=5000, help="samples per simulated board")
+    parser.add_argument("--drop-rate", type=float, default=0.05, help="chance a simulated frame's connection drops")
+    parser.add_argument("--reboot-rate", type=float, default=0.01, help="chance a simulated board reboots per batch")
+    parser.add_argument("--seed", type=int, default=2004)
+    args = parser.parse_args()
+
+    if args.simulate:
+        return asyncio.run(simulate(args))
+    try:
+        asyncio.run(serve(args))
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())